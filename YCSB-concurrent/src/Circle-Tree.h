@@ -18,6 +18,8 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <string>
+#include <limits>
 #include <string.h>
 #include <cassert>
 #include <climits>
@@ -25,6 +27,7 @@
 #include <mutex>
 #include <pthread.h>
 
+#include <cpuid.h>
 #include "config.h"
 
 #define CPU_FREQ_MHZ (1994)
@@ -34,7 +37,6 @@
 
 #define IS_FORWARD(c) (c % 2 == 0)
 
-using entry_key_t = int64_t;
 
 pthread_mutex_t print_mtx;
 
@@ -68,20 +70,160 @@ inline void mfence()
   asm volatile("mfence":::"memory");
 }
 
+// Cache line write-back used by clflush(), picked once at startup from
+// CPUID. Legacy clflush is fenced on both sides; clflushopt and clwb are
+// weakly ordered and only need a single trailing sfence. PM_FLUSH=clflush,
+// clflushopt or clwb overrides the choice for benchmarking.
+enum flush_insn_t {FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB};
+
+static const char *flush_insn_name[] = {"clflush", "clflushopt", "clwb"};
+
+static flush_insn_t detect_flush_insn()
+{
+  unsigned int eax, ebx, ecx, edx;
+  bool supported[3] = {true, false, false};
+  if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+    supported[FLUSH_CLFLUSHOPT] = (ebx >> 23) & 1;
+    supported[FLUSH_CLWB] = (ebx >> 24) & 1;
+  }
+  flush_insn_t insn = supported[FLUSH_CLWB] ? FLUSH_CLWB :
+    (supported[FLUSH_CLFLUSHOPT] ? FLUSH_CLFLUSHOPT : FLUSH_CLFLUSH);
+  const char *env = getenv("PM_FLUSH");
+  if(env){
+    for(int i = 0; i < 3; ++i){
+      if(!strcmp(env, flush_insn_name[i])){
+        if(supported[i]) insn = (flush_insn_t)i;
+        else fprintf(stderr, "PM_FLUSH=%s is not supported by this CPU\n", env);
+      }
+    }
+  }
+  fprintf(stderr, "flush instruction: %s\n", flush_insn_name[insn]);
+  return insn;
+}
+
+flush_insn_t flush_insn = detect_flush_insn();
+
+inline void sfence()
+{
+  asm volatile("sfence":::"memory");
+}
+
 inline void clflush(char *data, int len)
 {
   volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
   for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
     unsigned long etsc = read_tsc() + 
       (unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
-    asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
+    if(flush_insn == FLUSH_CLWB)
+      asm volatile("clwb %0" : "+m" (*(volatile char *)ptr));
+    else if(flush_insn == FLUSH_CLFLUSHOPT)
+      asm volatile("clflushopt %0" : "+m" (*(volatile char *)ptr));
+    else
+      asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
     while (read_tsc() < etsc) cpu_pause();
-    //++clflush_cnt;
   }
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
+  else
+    sfence();
+}
+
+// Variable-length string key. The first 8 bytes are kept inline as a
+// big-endian integer, so most comparisons are a single integer compare and
+// the rest of the key is only read when two prefixes tie. A key of at most
+// 8 bytes lives entirely in the prefix. Keys are NUL-terminated and may not
+// start with 8 0xff bytes, which is the largest key.
+class string_key{
+  public:
+    uint64_t prefix;     // first 8 bytes, zero padded
+    const char *suffix;  // bytes after the prefix, nullptr if there are none
+
+    string_key() : prefix(0), suffix(nullptr) {}
+
+    // The key refers to s, the tree copies the suffix when it keeps the key
+    explicit string_key(const char *s) : prefix(0), suffix(nullptr) {
+      int i = 0;
+      for(; i < 8 && s[i]; ++i)
+        prefix |= (uint64_t)(unsigned char)s[i] << (56 - 8 * i);
+      if(i == 8 && s[8])
+        suffix = s + 8;
+    }
+
+    static int compare(const string_key &a, const string_key &b) {
+      if(a.prefix != b.prefix)
+        return a.prefix < b.prefix ? -1 : 1;
+      if(a.suffix == b.suffix)
+        return 0;
+      if(!a.suffix || !b.suffix)
+        return a.suffix ? 1 : -1;
+      return strcmp(a.suffix, b.suffix);
+    }
+
+    // Copy of the key with the suffix moved to memory of its own and
+    // flushed. Only a leaf slot spills; keys are never removed here, so the
+    // suffixes live as long as the tree and a reader that copies a key torn
+    // by a concurrent shift still follows a valid suffix.
+    string_key spill() const {
+      string_key k = *this;
+      if(suffix) {
+        size_t len = strlen(suffix) + 1;
+        char *copy = (char *)malloc(len);
+        memcpy(copy, suffix, len);
+        clflush(copy, len);
+        k.suffix = copy;
+      }
+      return k;
+    }
+
+    std::string str() const {
+      std::string s;
+      for(int i = 0; i < 8 && (char)(prefix >> (56 - 8 * i)); ++i)
+        s += (char)(prefix >> (56 - 8 * i));
+      if(suffix)
+        s += suffix;
+      return s;
+    }
+
+    bool operator==(const string_key &k) const { return compare(*this, k) == 0; }
+    bool operator!=(const string_key &k) const { return compare(*this, k) != 0; }
+    bool operator<(const string_key &k) const { return compare(*this, k) < 0; }
+    bool operator<=(const string_key &k) const { return compare(*this, k) <= 0; }
+    bool operator>(const string_key &k) const { return compare(*this, k) > 0; }
+    bool operator>=(const string_key &k) const { return compare(*this, k) >= 0; }
+};
+
+namespace std {
+  template <>
+  class numeric_limits<string_key> {
+    public:
+      static const bool is_specialized = true;
+      static string_key max() {
+        string_key k;
+        k.prefix = ~0UL;
+        return k;
+      }
+  };
 }
 
+// Key as the tree keeps it in a node
+template <typename K>
+static inline K spill_key(const K &key) { return key; }
+static inline string_key spill_key(const string_key &key) { return key.spill(); }
+
+template <typename K>
+static inline void print_key(const K &key) { printf("%ld", (long)key); }
+static inline void print_key(const string_key &key) { printf("%s", key.str().c_str()); }
+
+// YCSB keys are indexed whole with -DSTRING_KEY, otherwise the drivers keep
+// the last 9 digits as an integer
+#ifdef STRING_KEY
+using entry_key_t = string_key;
+#else
+using entry_key_t = int64_t;
+#endif
+
 class page;
 
 class btree{
@@ -113,7 +255,7 @@ class entry{
 
   public :
     entry(){
-      key = LONG_MAX;
+      key = std::numeric_limits<entry_key_t>::max();
       ptr = (uint64_t)nullptr;
     }
 
@@ -125,17 +267,15 @@ const int cardinality = record_size;
 
 class header{
   private:
-    entry* records;              // 8B
-		uint16_t first_index;         // 4B
-		uint16_t num_valid_key;        // 4B
-		// mutex here
 		page* leftmost_ptr;            // 8B
 		page* right_sibling_ptr;             // 8B
-		uint16_t level;             // 4 bytes
-		// TODO: maybe delete switch_counter?
-		uint16_t is_deleted;         // 1 bytes
+		uint16_t first_index;         // 2B
+		uint16_t num_valid_key;        // 2B
+		uint16_t level;             // 2B
+		uint16_t is_deleted;         // 2B
     std::mutex *mtx;      // 8 bytes
-    pthread_spinlock_t slock;
+    pthread_spinlock_t slock;     // 4 bytes
+    char dummy[28];       // 28 bytes, pad the header to one cache line
 
     friend class page;
     friend class btree;
@@ -146,7 +286,6 @@ class header{
       
       pthread_spin_init(&slock,0);
 
-      records = new entry[cardinality];
 			first_index = 0;
 			num_valid_key = 0;
 			leftmost_ptr = nullptr;  
@@ -156,34 +295,36 @@ class header{
 
     ~header() {
       delete mtx;
-      delete records; 
       
     }
 };
 
 
 
+static_assert(sizeof(header) == CACHE_LINE_SIZE, "header must fit in one cache line");
+
 const int count_in_line = CACHE_LINE_SIZE / sizeof(entry);
 
 class page{
   private:
-    header hdr;  // header in persistent memory, 16 bytes
+    header hdr;  // header in persistent memory, 64 bytes
+    entry records[cardinality]; // slots in persistent memory, 16 bytes * n
 
   public:
     friend class btree;
 
     page(uint32_t level = 0) {
       hdr.level = level;
-      hdr.records[0].ptr = (uint64_t)nullptr;
+      records[0].ptr = (uint64_t)nullptr;
     }
 
     // this is called when tree grows
     page(page* left, entry_key_t key, page* right, uint32_t level = 0) {
       hdr.leftmost_ptr = left;  
       hdr.level = level;
-      hdr.records[0].key = key;
-      hdr.records[0].ptr = (uint64_t) right;
-      hdr.records[1].ptr = (uint64_t)nullptr;
+      records[0].key = key;
+      records[0].ptr = (uint64_t) right;
+      records[1].ptr = (uint64_t)nullptr;
 
       hdr.first_index = 0;
 			hdr.num_valid_key = 1;
@@ -246,8 +387,8 @@ class page{
 			char *ret = nullptr;
 			if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
 				for (i = 0; i < count(); ++i)
-					if (key == hdr.records[(hdr.first_index + i) & (cardinality - 1)].key) {
-						ret = (char *)hdr.records[(hdr.first_index + i) & (cardinality - 1)].ptr;
+					if (key == records[(hdr.first_index + i) & (cardinality - 1)].key) {
+						ret = (char *)records[(hdr.first_index + i) & (cardinality - 1)].ptr;
 						break;
 					}
 				if(ret) {
@@ -274,7 +415,7 @@ class page{
         }
       if(hdr.right_sibling_ptr && (hdr.right_sibling_ptr != nullptr)) {
 				// Compare this key with the first key of the sibling
-				if(key > hdr.right_sibling_ptr->hdr.records[hdr.right_sibling_ptr->hdr.first_index].key) {
+				if(key > hdr.right_sibling_ptr->records[hdr.right_sibling_ptr->hdr.first_index].key) {
 					return hdr.right_sibling_ptr->update(bt, key, ptr, offset, true);
 				}
 			}
@@ -292,8 +433,8 @@ class page{
           bool update_last_index = true) {
         bool is_left = false;
 				if(*num_entries == 0) {  // this page is empty
-					entry* new_entry = (entry*) &hdr.records[0];
-					entry* array_end = (entry*) &hdr.records[1];
+					entry* new_entry = (entry*) &records[0];
+					entry* array_end = (entry*) &records[1];
 					new_entry->key = (entry_key_t) key;
 					new_entry->ptr = (uint64_t) ptr;
 
@@ -301,7 +442,7 @@ class page{
 					hdr.first_index = 0;
 
 					if(flush) { // FIXME -- wangc@2020.03.08
-						clflush((char*) this, CACHE_LINE_SIZE);
+						clflush((char*) this, sizeof(header) + sizeof(entry));
 					}
 				}
 				else {
@@ -310,11 +451,11 @@ class page{
 
 					if (hdr.leftmost_ptr != nullptr){
 						for (i = *num_entries-1; i>=0; i--){
-							if (key < hdr.records[i].key){
-								hdr.records[i+1].ptr = hdr.records[i].ptr;
-								hdr.records[i+1].key = hdr.records[i].key;
+							if (key < records[i].key){
+								records[i+1].ptr = records[i].ptr;
+								records[i+1].key = records[i].key;
 								if(flush) {
-									uint64_t records_ptr = (uint64_t)(&hdr.records[i+1]);
+									uint64_t records_ptr = (uint64_t)(&records[i+1]);
 
 									int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
 									bool do_flush = (remainder == 0) || 
@@ -325,21 +466,21 @@ class page{
 									}
 								}
 							}else{
-								hdr.records[i+1].ptr = hdr.records[i].ptr;
-								hdr.records[i+1].key = key;
-								hdr.records[i+1].ptr = (uint64_t)ptr;
+								records[i+1].ptr = records[i].ptr;
+								records[i+1].key = key;
+								records[i+1].ptr = (uint64_t)ptr;
 								if(flush)
-                	clflush((char*)&hdr.records[i+1],sizeof(entry));
+                	clflush((char*)&records[i+1],sizeof(entry));
 								inserted = 1;
 								break;
 							}
 						}
 						if(inserted==0){
-							// hdr.records[0].ptr =(char*) hdr.leftmost_ptr;
-							hdr.records[0].key = key;
-							hdr.records[0].ptr = (uint64_t)ptr;
+							// records[0].ptr =(char*) hdr.leftmost_ptr;
+							records[0].key = key;
+							records[0].ptr = (uint64_t)ptr;
 							if(flush)
-								clflush((char*) &hdr.records[0], sizeof(entry)); 
+								clflush((char*) &records[0], sizeof(entry)); 
 							hdr.first_index = 0;
 						}
 					}else{
@@ -347,26 +488,26 @@ class page{
 
 						// shift the left part
 						// FIXME, do not use division like "*num_entries / 2". It is slow. Replace with bit shift. -- wangc@2020.03.08
-						if (key < hdr.records[(hdr.first_index + (*num_entries >> 1)) & (cardinality - 1)].key){
+						if (key < records[(hdr.first_index + (*num_entries >> 1)) & (cardinality - 1)].key){
 							// insert in the left part
 							// copy the leftmost_ptr first.
 							// FIXME, avoid 0.5 in code. Use integers. -- wangc@2020.03.08
 							for(i = 0; i<(*num_entries >> 1); i++){
 								int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-								if (key > hdr.records[idx].key){
+								if (key > records[idx].key){
 									int insert_idx = (idx - 1) & (cardinality - 1);
-									hdr.records[insert_idx].ptr = hdr.records[idx].ptr;
-									hdr.records[insert_idx].key = hdr.records[idx].key;
+									records[insert_idx].ptr = records[idx].ptr;
+									records[insert_idx].key = records[idx].key;
 									// flush the cacheline if A[idx] is at the start of a cache line;
 									if(flush) {
-										uint64_t records_ptr = (uint64_t)(&hdr.records[idx]);
+										uint64_t records_ptr = (uint64_t)(&records[idx]);
 
 										int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
 										bool do_flush = (remainder == 0) || 
 											((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
 											&& ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
 										if(do_flush) {
-											clflush((char*)(&hdr.records[insert_idx]),CACHE_LINE_SIZE);
+											clflush((char*)(&records[insert_idx]),CACHE_LINE_SIZE);
 										}
 									}
 								} else {
@@ -375,10 +516,10 @@ class page{
 							}// end for
 							// insert the key and ptr to new position
 							int insert_idx = (hdr.first_index + i - 1) & (cardinality - 1);
-							hdr.records[insert_idx].key = key;
-							hdr.records[insert_idx].ptr = (uint64_t)ptr;
+							records[insert_idx].key = key;
+							records[insert_idx].ptr = (uint64_t)ptr;
 							if(flush)
-								clflush((char*)&hdr.records[insert_idx], sizeof(entry));
+								clflush((char*)&records[insert_idx], sizeof(entry));
 							is_left = true;
 							inserted = 1;
 							// TODO: update b_node, flush b_node;
@@ -387,20 +528,20 @@ class page{
 
 							for(i = *num_entries - 1; i>=(*num_entries >> 1); i--){
 								int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-								if (key < hdr.records[idx].key){
+								if (key < records[idx].key){
 									int insert_idx = (idx + 1) & (cardinality - 1);
-									hdr.records[insert_idx].ptr = hdr.records[idx].ptr;
-									hdr.records[insert_idx].key = hdr.records[idx].key;
+									records[insert_idx].ptr = records[idx].ptr;
+									records[insert_idx].key = records[idx].key;
 									// flush the cacheline if A[idx] is at the start of a cache line;
 									if(flush) {
-										uint64_t records_ptr = (uint64_t)(&hdr.records[insert_idx]);
+										uint64_t records_ptr = (uint64_t)(&records[insert_idx]);
 
 										int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
 										bool do_flush = (remainder == 0) || 
 											((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
 											&& ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
 										if(do_flush) {
-											clflush((char*)(&hdr.records[insert_idx]),CACHE_LINE_SIZE);
+											clflush((char*)(&records[insert_idx]),CACHE_LINE_SIZE);
 										
 										}
 									}
@@ -410,19 +551,19 @@ class page{
 							}// end for
 							// insert the key and ptr to new position
 							int insert_idx = (hdr.first_index + i + 1) & (cardinality - 1);
-							hdr.records[insert_idx].key = key;
-							hdr.records[insert_idx].ptr = (uint64_t)ptr;
+							records[insert_idx].key = key;
+							records[insert_idx].ptr = (uint64_t)ptr;
 							inserted = 1;
 							if(flush)
-								clflush((char*)&hdr.records[insert_idx],sizeof(entry));
+								clflush((char*)&records[insert_idx],sizeof(entry));
 							// TODO: update b_node, flush b_node;
 						}
 						if(inserted==0){
 							
-							hdr.records[0].key = key;
-							hdr.records[0].ptr = (uint64_t)ptr;
+							records[0].key = key;
+							records[0].ptr = (uint64_t)ptr;
 							if(flush)
-								clflush((char*) &hdr.records[0], sizeof(entry)); 
+								clflush((char*) &records[0], sizeof(entry)); 
 							hdr.first_index = 0;
 						}
 					}
@@ -459,7 +600,7 @@ class page{
         // If this node has a sibling node,
         if(hdr.right_sibling_ptr && (hdr.right_sibling_ptr != invalid_sibling)) {
           // Compare this key with the first key of the sibling
-          if(key > hdr.right_sibling_ptr->hdr.records[0].key) {
+          if(key > hdr.right_sibling_ptr->records[0].key) {
             if(with_lock) { 
               hdr.mtx->unlock(); // Unlock the write lock
               // hdr.slock->unlock();
@@ -470,6 +611,9 @@ class page{
           }
         }
 
+        // the leaf slot keeps a copy of the key
+        if(hdr.leftmost_ptr == nullptr) key = spill_key(key);
+
         register int num_entries = count();
 
         // FAST
@@ -489,7 +633,7 @@ class page{
           // create a new node
           page* sibling = new page(hdr.level); 
           register int m = (hdr.first_index+(int)ceil(num_entries/2)) & (cardinality - 1);
-          entry_key_t split_key = hdr.records[m].key;
+          entry_key_t split_key = records[m].key;
 
           // migrate half of keys into the sibling
           int sibling_cnt = 0;
@@ -498,21 +642,21 @@ class page{
           if (hdr.leftmost_ptr == nullptr) { // leaf node
 						for (int i=0; i<=move_num; ++i) {
 							int idx = get_index(m + i); 
-							sibling->insert_key(hdr.records[idx].key, (char*)hdr.records[idx].ptr, set_all, &sibling_cnt, false);
+							sibling->insert_key(records[idx].key, (char*)records[idx].ptr, set_all, &sibling_cnt, false);
 							// MARK
-              hdr.records[idx].ptr = (uint64_t)nullptr;
-						//	hdr.records[idx].key = nullptr;
+              records[idx].ptr = (uint64_t)nullptr;
+						//	records[idx].key = nullptr;
 						}
 					}
 					else{ // internal node
 						for(int i=1;i<=move_num;++i){ 
 							int idx = get_index(m + i);
-							sibling->insert_key(hdr.records[idx].key, (char*)hdr.records[idx].ptr, set_all, &sibling_cnt, false);
-							hdr.records[idx].ptr = (uint64_t)nullptr;
-						//	hdr.records[idx].key = nullptr;
+							sibling->insert_key(records[idx].key, (char*)records[idx].ptr, set_all, &sibling_cnt, false);
+							records[idx].ptr = (uint64_t)nullptr;
+						//	records[idx].key = nullptr;
 						}
 						// TODO: have to do with the leftmost_ptr
-						sibling->hdr.leftmost_ptr = (page*) hdr.records[m].ptr;
+						sibling->hdr.leftmost_ptr = (page*) records[m].ptr;
 					}
 
           sibling->hdr.right_sibling_ptr = hdr.right_sibling_ptr;
@@ -522,8 +666,8 @@ class page{
           clflush((char*) &hdr, sizeof(hdr));
 
           
-          hdr.records[m].ptr = (uint64_t)nullptr;
-          clflush((char*) &hdr.records[m], sizeof(entry));
+          records[m].ptr = (uint64_t)nullptr;
+          clflush((char*) &records[m], sizeof(entry));
 
           hdr.num_valid_key -= sibling_cnt;
 					clflush((char *)&(hdr.num_valid_key), sizeof(uint32_t));
@@ -583,14 +727,14 @@ class page{
 
                                 if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
                                         for (i = 0; i < count(); ++i)
-                                                if (key == hdr.records[(hdr.first_index + i) & (cardinality - 1)].key) {
-                                                        ret = (char*)hdr.records[(hdr.first_index + i) & (cardinality - 1)].ptr;
+                                                if (key == records[(hdr.first_index + i) & (cardinality - 1)].key) {
+                                                        ret = (char*)records[(hdr.first_index + i) & (cardinality - 1)].ptr;
                                                         break;
                                                 }
                                         if(ret) {
                                                 return ret;
                                         }
-                                        if((t = (char *)hdr.right_sibling_ptr) != nullptr && key >= ((page *)t)->hdr.records[(((page *)t)->hdr).first_index].key)
+                                        if((t = (char *)hdr.right_sibling_ptr) != nullptr && key >= ((page *)t)->records[(((page *)t)->hdr).first_index].key)
                                                 return t;
 
                                         return nullptr;
@@ -598,23 +742,23 @@ class page{
                                 else { // internal node, which you do not have circular design. -- wangc@2020.03.22
                                         ret = nullptr;
 
-                                        if(key < (k = hdr.records[0].key)) {
+                                        if(key < (k = records[0].key)) {
                                                 ret = (char *)hdr.leftmost_ptr;
                                         } else {
 
                                                 for(i = 1; i < count(); ++i) {
-                                                        if(key < (k = hdr.records[i].key)) {
-                                                                ret = (char*)hdr.records[i - 1].ptr;
+                                                        if(key < (k = records[i].key)) {
+                                                                ret = (char*)records[i - 1].ptr;
                                                                 break;
                                                         }
                                                 }
 
                                                 if(!ret) {
-                                                        ret = (char*)hdr.records[i - 1].ptr;
+                                                        ret = (char*)records[i - 1].ptr;
                                                 }
                                         }
                                         if ((t = (char *)hdr.right_sibling_ptr) != nullptr) {
-                                                if(key >= ((page *)t)->hdr.records[0].key)
+                                                if(key >= ((page *)t)->records[0].key)
                                                         return t;
                                         }
 
@@ -644,8 +788,10 @@ class page{
 
       for(int i=0; i < hdr.num_valid_key;++i){
         int idx = get_index(hdr.first_index + i);
-        printf("K:%ld, ", hdr.records[idx].key);
-        printf("V:%x. ",hdr.records[idx].ptr);
+        printf("K:");
+        print_key(records[idx].key);
+        printf(", ");
+        printf("V:%x. ",records[idx].ptr);
       }
         
 			printf("\n");
@@ -665,7 +811,7 @@ class page{
         ((page*) hdr.leftmost_ptr)->printAll();
         for(int i=0;i < hdr.num_valid_key;++i){
           int idx = get_index(hdr.first_index + i);
-          ((page*) hdr.records[idx].ptr)->printAll();
+          ((page*) records[idx].ptr)->printAll();
         }
       }
     }
@@ -701,7 +847,9 @@ char *btree::btree_search(entry_key_t key, int offset){
 	}
 
 	if(!t) {	
-		printf("NOT FOUND %lu, t = %x\n", key, t);
+		printf("NOT FOUND ");
+		print_key(key);
+		printf("\n");
 		return nullptr;
 	}
 
@@ -722,15 +870,14 @@ void btree::btree_update(entry_key_t key,const char* right, int offset){
 
 // insert the key in the leaf node
 void btree::btree_insert(entry_key_t key, char* right, int offset){ //need to be string
-	page* p = (page*)root;
-
-	while(p->hdr.leftmost_ptr != nullptr) {
-		p = (page*)p->linear_search(key, offset);
-	}
+	page* p;
 
-	if(!p->store(this, nullptr, key, right, offset, true, true)) { // store 
-		btree_insert(key, right, offset);
-	}
+	do {
+		p = (page*)root;
+		while(p->hdr.leftmost_ptr != nullptr) {
+			p = (page*)p->linear_search(key, offset);
+		}
+	} while(!p->store(this, nullptr, key, right, offset, true, true)); // store 
 }
 
 // store the key into the node at the given level 
@@ -769,7 +916,9 @@ void btree::btree_delete(entry_key_t key, int offset) {
 		}
 	}
 	else {
-		printf("not found the key to delete %lu\n", key);
+		printf("not found the key to delete ");
+		print_key(key);
+		printf("\n");
 	}
 }
 
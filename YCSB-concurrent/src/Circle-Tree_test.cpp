@@ -21,6 +21,17 @@ void clear_cache() {
 	delete[] garbage;
 }
 
+// Tree key of a YCSB key such as user7118824590470993170: the whole string
+// with -DSTRING_KEY, otherwise its last 9 digits. A string key refers to
+// key, the tree keeps a copy of what it stores.
+entry_key_t ycsb_key(const string &key){
+#ifdef STRING_KEY
+    return string_key(key.c_str());
+#else
+    return stoi(key.substr(key.length() - 9));
+#endif
+}
+
 char* hmset(istringstream &ss){
     string word, val;
     int offset = 0;
@@ -47,7 +58,7 @@ long long insertion(btree *bt, char *load_path){
         exit(-1);  
     }
     string line, word, key;
-    int64_t i_key;
+    entry_key_t i_key;
     char * vals = nullptr;
     const char* p_val = nullptr;
     int offset;
@@ -58,10 +69,9 @@ long long insertion(btree *bt, char *load_path){
         cut_word >> word;
         if (word == "HMSET"){
             cut_word >> key;  // user info
-            key = key.substr(key.length() - 9);
             // cout << key << endl;
             vals = hmset(cut_word);
-            i_key = stoi(key);
+            i_key = ycsb_key(key);
             clock_gettime(CLOCK_MONOTONIC,&start);
             bt->btree_insert(i_key, vals, -1);
             clock_gettime(CLOCK_MONOTONIC,&end);
@@ -86,7 +96,7 @@ vector<long long> search_update(btree *bt, char *run_path){
         exit(-1);  
     }
     string line, word, key;
-    int64_t i_key;
+    entry_key_t i_key;
     char * vals = nullptr;
     const char* p_val = nullptr;
     int offset;
@@ -99,8 +109,7 @@ vector<long long> search_update(btree *bt, char *run_path){
         cut_word >> word;
         if (word == "HGETALL"){
             cut_word >> key;  // user info
-            key = key.substr(key.length() - 9);
-            i_key = stoi(key);
+            i_key = ycsb_key(key);
             clock_gettime(CLOCK_MONOTONIC,&start);
             bt->btree_search(i_key, -1);
             
@@ -112,13 +121,12 @@ vector<long long> search_update(btree *bt, char *run_path){
         }else if(word == "HMSET"){
             
             cut_word >> key;  // user info
-            key = key.substr(key.length() - 9);
             cut_word >> word;  // field info
             offset = *(word.end() - 1) - '0';
             // cout << offset << endl;
 
             cut_word >> word; // val info;
-            i_key = stoi(key);
+            i_key = ycsb_key(key);
             // cout << key << endl;
             p_val = word.c_str();
             clock_gettime(CLOCK_MONOTONIC,&start);
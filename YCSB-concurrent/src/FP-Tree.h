@@ -25,6 +25,7 @@
 #include <mutex>
 #include <pthread.h>
 
+#include <cpuid.h>
 #include "config.h"
 
 #define CPU_FREQ_MHZ (1994)
@@ -68,18 +69,64 @@ inline void mfence()
   asm volatile("mfence":::"memory");
 }
 
+// Cache line write-back used by clflush(), picked once at startup from
+// CPUID. Legacy clflush is fenced on both sides; clflushopt and clwb are
+// weakly ordered and only need a single trailing sfence. PM_FLUSH=clflush,
+// clflushopt or clwb overrides the choice for benchmarking.
+enum flush_insn_t {FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB};
+
+static const char *flush_insn_name[] = {"clflush", "clflushopt", "clwb"};
+
+static flush_insn_t detect_flush_insn()
+{
+  unsigned int eax, ebx, ecx, edx;
+  bool supported[3] = {true, false, false};
+  if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+    supported[FLUSH_CLFLUSHOPT] = (ebx >> 23) & 1;
+    supported[FLUSH_CLWB] = (ebx >> 24) & 1;
+  }
+  flush_insn_t insn = supported[FLUSH_CLWB] ? FLUSH_CLWB :
+    (supported[FLUSH_CLFLUSHOPT] ? FLUSH_CLFLUSHOPT : FLUSH_CLFLUSH);
+  const char *env = getenv("PM_FLUSH");
+  if(env){
+    for(int i = 0; i < 3; ++i){
+      if(!strcmp(env, flush_insn_name[i])){
+        if(supported[i]) insn = (flush_insn_t)i;
+        else fprintf(stderr, "PM_FLUSH=%s is not supported by this CPU\n", env);
+      }
+    }
+  }
+  fprintf(stderr, "flush instruction: %s\n", flush_insn_name[insn]);
+  return insn;
+}
+
+flush_insn_t flush_insn = detect_flush_insn();
+
+inline void sfence()
+{
+  asm volatile("sfence":::"memory");
+}
+
 inline void clflush(char *data, int len)
 {
   volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
   for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
     unsigned long etsc = read_tsc() + 
       (unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
-    asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
+    if(flush_insn == FLUSH_CLWB)
+      asm volatile("clwb %0" : "+m" (*(volatile char *)ptr));
+    else if(flush_insn == FLUSH_CLFLUSHOPT)
+      asm volatile("clflushopt %0" : "+m" (*(volatile char *)ptr));
+    else
+      asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
     while (read_tsc() < etsc) cpu_pause();
-    //++clflush_cnt;
   }
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
+  else
+    sfence();
 }
 
 unsigned char cal_hash(unsigned long x) 
@@ -172,7 +219,8 @@ class header{
 
     ~header() {
       delete mtx;
-      delete records; 
+      delete[] records; 
+      delete[] buffer_records;
       
     }
 };
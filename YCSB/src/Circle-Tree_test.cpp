@@ -21,6 +21,17 @@ void clear_cache() {
 	delete[] garbage;
 }
 
+// Tree key of a YCSB key such as user7118824590470993170: the whole string
+// with -DSTRING_KEY, otherwise its last 9 digits. A string key refers to
+// key, the tree keeps a copy of what it stores.
+entry_key_t ycsb_key(const string &key){
+#ifdef STRING_KEY
+    return string_key(key.c_str());
+#else
+    return stoi(key.substr(key.length() - 9));
+#endif
+}
+
 char* hmset(istringstream &ss){
     string word, val;
     int offset = 0;
@@ -87,7 +98,7 @@ int main(int argc, char** argv)
         exit(-1);  
     }
     string line, word, key;
-    int64_t i_key;
+    entry_key_t i_key;
     char * vals = nullptr;
     const char* p_val = nullptr;
     int offset;
@@ -98,10 +109,9 @@ int main(int argc, char** argv)
         cut_word >> word;
         if (word == "HMSET"){
             cut_word >> key;  // user info
-            key = key.substr(key.length() - 9);
             // cout << key << endl;
             vals = hmset(cut_word);
-            i_key = stoi(key);
+            i_key = ycsb_key(key);
             clock_gettime(CLOCK_MONOTONIC,&start);
             bt->btree_insert(i_key, vals, -1);
             clock_gettime(CLOCK_MONOTONIC,&end);
@@ -129,8 +139,7 @@ int main(int argc, char** argv)
         cut_word >> word;
         if (word == "HGETALL"){
             cut_word >> key;  // user info
-            key = key.substr(key.length() - 9);
-            i_key = stoi(key);
+            i_key = ycsb_key(key);
             clock_gettime(CLOCK_MONOTONIC,&start);
             bt->btree_search(i_key, -1);
             
@@ -140,13 +149,12 @@ int main(int argc, char** argv)
         }else if(word == "HMSET"){
             
             cut_word >> key;  // user info
-            key = key.substr(key.length() - 9);
             cut_word >> word;  // field info
             offset = *(word.end() - 1) - '0';
             // cout << offset << endl;
 
             cut_word >> word; // val info;
-            i_key = stoi(key);
+            i_key = ycsb_key(key);
             // cout << key << endl;
             p_val = word.c_str();
             clock_gettime(CLOCK_MONOTONIC,&start);
@@ -165,6 +173,8 @@ int main(int argc, char** argv)
     //bt->printAll();
     return 0;
 
+#ifndef STRING_KEY
+    // integer keys from a plain key file
     for(int i=0; i<num_data; ++i)
         ifs >> keys[i]; 
 
@@ -211,6 +221,7 @@ int main(int argc, char** argv)
     }
 
     bt->printAll();
+#endif
 
     
 
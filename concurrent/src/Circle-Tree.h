@@ -18,13 +18,20 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <iterator>
+#include <string>
+#include <algorithm>
 #include <string.h>
 #include <cassert>
 #include <climits>
 #include <future>
 #include <mutex>
 #include <pthread.h>
+#include <immintrin.h>
+#include <limits>
+#include <type_traits>
 
+#include <cpuid.h>
 #include "config.h"
 
 // #include <boost/atomic.hpp>
@@ -90,122 +97,565 @@ inline void mfence()
   asm volatile("mfence":::"memory");
 }
 
+// Cache line write-back used by clflush(), picked once at startup from
+// CPUID. Legacy clflush is fenced on both sides; clflushopt and clwb are
+// weakly ordered and only need a single trailing sfence. PM_FLUSH=clflush,
+// clflushopt or clwb overrides the choice for benchmarking.
+enum flush_insn_t {FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB};
+
+static const char *flush_insn_name[] = {"clflush", "clflushopt", "clwb"};
+
+static flush_insn_t detect_flush_insn()
+{
+  unsigned int eax, ebx, ecx, edx;
+  bool supported[3] = {true, false, false};
+  if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+    supported[FLUSH_CLFLUSHOPT] = (ebx >> 23) & 1;
+    supported[FLUSH_CLWB] = (ebx >> 24) & 1;
+  }
+  flush_insn_t insn = supported[FLUSH_CLWB] ? FLUSH_CLWB :
+    (supported[FLUSH_CLFLUSHOPT] ? FLUSH_CLFLUSHOPT : FLUSH_CLFLUSH);
+  const char *env = getenv("PM_FLUSH");
+  if(env){
+    for(int i = 0; i < 3; ++i){
+      if(!strcmp(env, flush_insn_name[i])){
+        if(supported[i]) insn = (flush_insn_t)i;
+        else fprintf(stderr, "PM_FLUSH=%s is not supported by this CPU\n", env);
+      }
+    }
+  }
+  fprintf(stderr, "flush instruction: %s\n", flush_insn_name[insn]);
+  return insn;
+}
+
+flush_insn_t flush_insn = detect_flush_insn();
+
+inline void sfence()
+{
+  asm volatile("sfence":::"memory");
+}
+
+inline void flush_line(volatile char *ptr)
+{
+  unsigned long etsc = read_tsc() + 
+    (unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
+  if(flush_insn == FLUSH_CLWB)
+    asm volatile("clwb %0" : "+m" (*(volatile char *)ptr));
+  else if(flush_insn == FLUSH_CLFLUSHOPT)
+    asm volatile("clflushopt %0" : "+m" (*(volatile char *)ptr));
+  else
+    asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
+  while (read_tsc() < etsc) cpu_pause();
+}
+
+inline void persist_fence()
+{
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
+  else
+    sfence();
+}
+
 inline void clflush(char *data, int len)
 {
   volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-  mfence();
-  for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
-    unsigned long etsc = read_tsc() + 
-      (unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
-    asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
-    while (read_tsc() < etsc) cpu_pause();
-    //++clflush_cnt;
-  }
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
+  for(; ptr<data+len; ptr+=CACHE_LINE_SIZE)
+    flush_line(ptr);
+  persist_fence();
+}
+
+// Dirty cache lines of one node update, written back together with a
+// single fence. store() is called before writing to data: if that touches
+// a line not yet in the set, the lines collected so far are persisted
+// first, which keeps the line-by-line ordering a shift depends on.
+class flush_set {
+  private:
+    static const int max_lines = 8;
+    char *lines[max_lines];
+    int num_lines;
+
+    bool contains(char *line) {
+      for(int i = 0; i < num_lines; ++i)
+        if(lines[i] == line) return true;
+      return false;
+    }
+
+  public:
+    flush_set() : num_lines(0) {}
+
+    void add(char *data, int len) {
+      char *line = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
+      for(; line<data+len; line+=CACHE_LINE_SIZE){
+        if(contains(line)) continue;
+        if(num_lines == max_lines) persist();
+        lines[num_lines++] = line;
+      }
+    }
+
+    void store(char *data, int len) {
+      char *line = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
+      for(; line<data+len; line+=CACHE_LINE_SIZE){
+        if(!contains(line)){
+          persist();
+          break;
+        }
+      }
+      add(data, len);
+    }
+
+    void persist() {
+      if(num_lines == 0) return;
+      if(flush_insn == FLUSH_CLFLUSH)
+        mfence();
+      for(int i = 0; i < num_lines; ++i)
+        flush_line(lines[i]);
+      persist_fence();
+      num_lines = 0;
+    }
+};
+
+// Variable-length string key. The first 8 bytes are kept inline as a
+// big-endian integer, so most comparisons are a single integer compare and
+// the rest of the key is only read when two prefixes tie. A key of at most
+// 8 bytes lives entirely in the prefix. Keys are NUL-terminated and may not
+// start with 8 0xff bytes, which is the largest key.
+class string_key{
+  public:
+    uint64_t prefix;     // first 8 bytes, zero padded
+    const char *suffix;  // bytes after the prefix, nullptr if there are none
+
+    string_key() : prefix(0), suffix(nullptr) {}
+
+    // The key refers to s, the tree copies the suffix when it keeps the key
+    explicit string_key(const char *s) : prefix(0), suffix(nullptr) {
+      int i = 0;
+      for(; i < 8 && s[i]; ++i)
+        prefix |= (uint64_t)(unsigned char)s[i] << (56 - 8 * i);
+      if(i == 8 && s[8])
+        suffix = s + 8;
+    }
+
+    static int compare(const string_key &a, const string_key &b) {
+      if(a.prefix != b.prefix)
+        return a.prefix < b.prefix ? -1 : 1;
+      if(a.suffix == b.suffix)
+        return 0;
+      if(!a.suffix || !b.suffix)
+        return a.suffix ? 1 : -1;
+      return strcmp(a.suffix, b.suffix);
+    }
+
+    // Copy of the key with the suffix moved to memory of its own and
+    // flushed. The slot the copy is stored in owns it, a separator gets a
+    // copy of its own, see free_key.
+    string_key spill() const {
+      string_key k = *this;
+      if(suffix) {
+        size_t len = strlen(suffix) + 1;
+        char *copy = (char *)malloc(len);
+        memcpy(copy, suffix, len);
+        clflush(copy, len);
+        k.suffix = copy;
+      }
+      return k;
+    }
+
+    std::string str() const {
+      std::string s;
+      for(int i = 0; i < 8 && (char)(prefix >> (56 - 8 * i)); ++i)
+        s += (char)(prefix >> (56 - 8 * i));
+      if(suffix)
+        s += suffix;
+      return s;
+    }
+
+    bool operator==(const string_key &k) const { return compare(*this, k) == 0; }
+    bool operator!=(const string_key &k) const { return compare(*this, k) != 0; }
+    bool operator<(const string_key &k) const { return compare(*this, k) < 0; }
+    bool operator<=(const string_key &k) const { return compare(*this, k) <= 0; }
+    bool operator>(const string_key &k) const { return compare(*this, k) > 0; }
+    bool operator>=(const string_key &k) const { return compare(*this, k) >= 0; }
+};
+
+namespace std {
+  template <>
+  class numeric_limits<string_key> {
+    public:
+      static const bool is_specialized = true;
+      static string_key max() {
+        string_key k;
+        k.prefix = ~0UL;
+        return k;
+      }
+  };
+}
+
+// Key as the tree keeps it in a node
+template <typename K>
+static inline K spill_key(const K &key) { return key; }
+static inline string_key spill_key(const string_key &key) { return key.spill(); }
+
+inline void epoch_retire_raw(void *, void (*)(void *), size_t);
+
+// Release what spill_key allocated once the slot holding the key is gone.
+// A reader may still be comparing against it, the epochs free it later.
+template <typename K>
+static inline void free_key(const K &key) {}
+static inline void free_key(const string_key &key) {
+  if(key.suffix)
+    epoch_retire_raw((void *)key.suffix, free, strlen(key.suffix) + 1);
 }
 
-class page;
+template <typename K>
+static inline void print_key(const K &key) { printf("%ld", (long)key); }
+static inline void print_key(const string_key &key) { printf("%s", key.str().c_str()); }
+
+// Slot layout of a node: key and pointer interleaved in one array, or the
+// keys in one array and the pointers in a parallel one, so a search only
+// reads the cache lines holding keys.
+enum node_layout_t { NODE_AOS = 0, NODE_SOA = 1 };
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS> class page_t;
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS> class btree_iterator_t;
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS> class btree_reverse_iterator_t;
+
+template <typename T>
+void epoch_retire(T *node);
+
+// How a node is searched: slot-by-slot scan, binary search over the
+// logical (rotated) index of the circular array, or the vectorized
+// key comparison kernel.
+enum search_mode_t { LINEAR_SEARCH = 0, BINARY_SEARCH = 1, SIMD_SEARCH = 2 };
+
+// Where a full node splits: SPLIT_ADAPTIVE halves it unless APPEND_RUN or
+// so of its recent inserts landed among its last 1/APPEND_SPLIT keys,
+// SPLIT_EVEN always halves it and SPLIT_APPEND splits unevenly whenever the
+// overflowing key lands there. An uneven split keeps all but 1/APPEND_SPLIT
+// of the keys, so nodes behind an ascending key stream stay nearly full.
+enum split_policy_t { SPLIT_ADAPTIVE = 0, SPLIT_EVEN = 1, SPLIT_APPEND = 2 };
+
+#define APPEND_RUN 8
+#define APPEND_SPLIT 10
+
+// Levels a descent remembers for the splits and merges it causes, a taller
+// tree finds the parents of its upper levels from the root
+#define PATH_DEPTH 32
+
+// The tree is a template over the key type, an integer or string_key, the
+// value type, the number of slots per node and their layout. Leaf slots keep
+// values as char *, so a value has to be
+// a pointer or an integer of the same size. The cardinality is a power of
+// two, which turns the circular index arithmetic into masks with constant
+// operands.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS>
+class btree_t{
+  static_assert(Cardinality >= 8 && (Cardinality & (Cardinality - 1)) == 0,
+      "cardinality must be a power of two");
+  static_assert(Cardinality <= 65536, "slot indexes are 16 bits");
+  static_assert(std::is_integral<Key>::value || std::is_same<Key, string_key>::value,
+      "keys must be integers or string_key");
+  static_assert((std::is_pointer<Value>::value || std::is_integral<Value>::value) &&
+      sizeof(Value) == sizeof(char *), "values must fit in a slot pointer");
 
-class btree{
   private:
+    typedef Key entry_key_t;
+    typedef page_t<Key, Value, Cardinality, Layout> page;
+    typedef btree_t<Key, Value, Cardinality, Layout> btree;
+    typedef btree_iterator_t<Key, Value, Cardinality, Layout> btree_iterator;
+    typedef btree_reverse_iterator_t<Key, Value, Cardinality, Layout> btree_reverse_iterator;
+    static const int cardinality = Cardinality;
+
     int height;
     char* root;
+    search_mode_t search_mode;
+    split_policy_t split_policy;
+    bool use_finger;
+
+    // Nodes a descent went through, by level, so a split or merge of the
+    // same operation starts looking for the parent there. Another thread may
+    // have split one since, store() and btree_delete_internal then move
+    // right, or retired one, which sends store() back to the root and
+    // leaves the merge out.
+    struct path_t {
+      int top;  // level of the root the descent started at, -1 for none
+      page *node[PATH_DEPTH];
+      path_t() : top(-1) {}
+      void start(page *root) { top = root->hdr.level < PATH_DEPTH ? (int)root->hdr.level : -1; }
+      void visit(page *p) {
+        if((int)p->hdr.level <= top)
+          node[p->hdr.level] = p;
+      }
+      page *at(uint32_t level) { return (int)level <= top ? node[level] : nullptr; }
+    };
+
+    // Leaf a thread reached last in a tree and the fences of its key range
+    // as of one version of the leaf
+    struct finger_t {
+      btree *tree;
+      uint64_t epoch;    // the descent's, no page it saw is freed before it ends
+      page *leaf;
+      uint64_t version;  // of the leaf when high was taken from it
+      bool has_low, has_high;  // no separator bounds the first or last leaf
+      entry_key_t low, high;
+      path_t path;  // the descent that found the leaf
+      finger_t() : tree(nullptr) {}
+    };
+    static thread_local finger_t finger;
+
+    bool finger_fence(finger_t &);
+    page *finger_leaf(entry_key_t);
 
   public:
 
-    btree();
+    btree_t(search_mode_t mode = LINEAR_SEARCH);
+    void set_search_mode(search_mode_t mode) { search_mode = mode; }
+    void set_split_policy(split_policy_t policy) { split_policy = policy; }
+    void set_finger(bool on) { use_finger = on; }
     void setNewRoot(char *);
     void getNumberOfNodes();
-    void btree_insert(entry_key_t, char*);
-    void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
+    void btree_insert(entry_key_t, Value);
+    void multi_put(entry_key_t *, Value *, int);
+    void btree_insert_internal(char *, entry_key_t, char *, uint32_t, path_t * = nullptr);
+    template <typename It>
+      void bulk_load(It first, It last, double fill_factor = 1.0, int n_threads = 1);
+    static void bulk_link_level(std::vector<page *> &, int);
+    static std::vector<page *> bulk_build_parents(std::vector<page *> &,
+        std::vector<entry_key_t> &, uint32_t, long, int);
     void btree_delete(entry_key_t);
-    void btree_delete_internal
-			(entry_key_t, char *, uint32_t, entry_key_t *, bool *, page **, page**);
-    char *btree_search(entry_key_t);
-    void btree_search_range(entry_key_t, entry_key_t, unsigned long *); 
+    void btree_delete_internal(entry_key_t, char *, uint32_t, path_t * = nullptr);
+    Value btree_search(entry_key_t);
+    void multi_get(entry_key_t *, int, Value *);
+    int btree_search_range(entry_key_t, entry_key_t, unsigned long *, int); 
+    int btree_search_range_reverse(entry_key_t, entry_key_t, unsigned long *, int); 
     void printAll();
 
-    friend class page;
+    template <typename, typename, int, node_layout_t> friend class page_t;
+    template <typename, typename, int, node_layout_t> friend class btree_iterator_t;
+    template <typename, typename, int, node_layout_t> friend class btree_reverse_iterator_t;
 };
 
-class entry{ 
+template <typename Key>
+class entry_t{ 
   private:
-    entry_key_t key; // 8 bytes
+    Key key; // 8 bytes
     char* ptr; // 8 bytes
 
   public :
-    entry(){
-      key = LONG_MAX;
+    entry_t(){
+      key = std::numeric_limits<Key>::max();
       ptr = nullptr;
     }
 
-    friend class page;
-    friend class btree;
+    template <typename, typename, int, node_layout_t> friend class page_t;
+    template <typename, typename, int, node_layout_t> friend class btree_t;
 };
 
-const int cardinality = record_size;
+// Slot i of a node whose keys and pointers live in separate arrays
+template <typename Key>
+class slot_ref_t{
+  public:
+    Key &key;
+    char *&ptr;
+
+    slot_ref_t(Key &k, char *&p) : key(k), ptr(p) {}
+    slot_ref_t &operator=(const slot_ref_t &s) {
+      key = s.key;
+      ptr = s.ptr;
+      return *this;
+    }
+};
+
+// Does a field of len bytes at addr start a cache line, or run into the
+// next one? Shifts write back a line once they reach it.
+static inline bool opens_line(void *addr, int len) {
+  int remainder = (uint64_t)addr & (CACHE_LINE_SIZE - 1);
+  return (remainder == 0) ||
+    ((((int)(remainder + len) / CACHE_LINE_SIZE) == 1) &&
+     ((remainder + len) & (CACHE_LINE_SIZE - 1)) != 0);
+}
+
+// The slots of a node. records[i] gives slot i with .key and .ptr in either
+// layout; the rest names the cache lines slot i lives in.
+template <typename Key, int Cardinality, node_layout_t Layout>
+class records_t;
+
+template <typename Key, int Cardinality>
+class records_t<Key, Cardinality, NODE_AOS>{
+  private:
+    typedef entry_t<Key> entry;
+    entry e[Cardinality];
+
+  public:
+    typedef entry &reference;
+    static const int per_line = CACHE_LINE_SIZE / sizeof(entry);
+
+    inline reference operator[](int i) { return e[i]; }
+    // contiguous slots from i, in the form the search kernels take
+    inline entry *run(int i) { return &e[i]; }
+
+    inline void add(flush_set &fs, int i) { fs.add((char *)&e[i], sizeof(entry)); }
+    inline void store(flush_set &fs, int i) { fs.store((char *)&e[i], sizeof(entry)); }
+    inline void flush(int i, int n) { clflush((char *)&e[i], n * sizeof(entry)); }
+    inline void prefetch(int i) { __builtin_prefetch(&e[i]); }
+    inline void prefetch_slot(int i) { __builtin_prefetch(&e[i]); }
+
+    inline void flush_if_opens_line(int i) {
+      if(opens_line(&e[i], sizeof(entry)))
+        clflush((char *)&e[i], CACHE_LINE_SIZE);
+    }
+
+    // write back slot i unless it shares the lines written back last
+    inline void write_back(int i, char **last) {
+      char *line = (char *)((unsigned long)&e[i] & ~(CACHE_LINE_SIZE - 1));
+      if(line != last[0])
+        ::flush_line(line);
+      last[0] = line;
+    }
+};
 
-class header{
+template <typename Key, int Cardinality>
+class records_t<Key, Cardinality, NODE_SOA>{
   private:
-    entry* records;              // 8B
-		uint16_t first_index;         // 4B
-		uint16_t num_valid_key;        // 4B
-		// mutex here
+    Key keys[Cardinality];
+    alignas(CACHE_LINE_SIZE) char *ptrs[Cardinality];
+
+  public:
+    typedef slot_ref_t<Key> reference;
+    static const int per_line = CACHE_LINE_SIZE / sizeof(Key);
+
+    records_t() {
+      for(int i = 0; i < Cardinality; ++i) {
+        keys[i] = std::numeric_limits<Key>::max();
+        ptrs[i] = nullptr;
+      }
+    }
+
+    inline reference operator[](int i) { return reference(keys[i], ptrs[i]); }
+    inline Key *run(int i) { return &keys[i]; }
+
+    inline void add(flush_set &fs, int i) {
+      fs.add((char *)&keys[i], sizeof(Key));
+      fs.add((char *)&ptrs[i], sizeof(char *));
+    }
+    inline void store(flush_set &fs, int i) {
+      fs.store((char *)&keys[i], sizeof(Key));
+      fs.store((char *)&ptrs[i], sizeof(char *));
+    }
+    inline void flush(int i, int n) {
+      clflush((char *)&keys[i], n * sizeof(Key));
+      clflush((char *)&ptrs[i], n * sizeof(char *));
+    }
+    // a search reads the keys, the pointer of the slot found comes last
+    inline void prefetch(int i) { __builtin_prefetch(&keys[i]); }
+    inline void prefetch_slot(int i) {
+      __builtin_prefetch(&keys[i]);
+      __builtin_prefetch(&ptrs[i]);
+    }
+
+    inline void flush_if_opens_line(int i) {
+      if(opens_line(&keys[i], sizeof(Key)))
+        clflush((char *)&keys[i], CACHE_LINE_SIZE);
+      if(opens_line(&ptrs[i], sizeof(char *)))
+        clflush((char *)&ptrs[i], CACHE_LINE_SIZE);
+    }
+
+    inline void write_back(int i, char **last) {
+      char *line = (char *)((unsigned long)&keys[i] & ~(CACHE_LINE_SIZE - 1));
+      if(line != last[0])
+        ::flush_line(line);
+      last[0] = line;
+      line = (char *)((unsigned long)&ptrs[i] & ~(CACHE_LINE_SIZE - 1));
+      if(line != last[1])
+        ::flush_line(line);
+      last[1] = line;
+    }
+};
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class header_t{
+  private:
+    typedef page_t<Key, Value, Cardinality, Layout> page;
+
 		page* leftmost_ptr;            // 8B
 		page* right_sibling_ptr;             // 8B
-		uint16_t level;             // 4 bytes
-		// TODO: maybe delete switch_counter?
-		uint16_t is_deleted;         // 1 bytes
-    std::mutex *mtx;      // 8 bytes
-    pthread_spinlock_t slock;
-
-    friend class page;
-    friend class btree;
+		uint16_t first_index;         // 2B
+		uint16_t num_valid_key;        // 2B
+		uint16_t level;             // 2B
+		uint16_t is_deleted;         // 2B
+    uint64_t lock_word;   // 8 bytes, writer lock and node version
+    Key low_key;          // smallest key the node covers, set when it is split off
+    uint16_t appends;     // 2 bytes, +1 per append, halved by other inserts
+    char dummy[30 - sizeof(Key)]; // pad the header to one cache line
+
+    template <typename, typename, int, node_layout_t> friend class page_t;
+    template <typename, typename, int, node_layout_t> friend class btree_t;
+    template <typename, typename, int, node_layout_t> friend class btree_iterator_t;
+    template <typename, typename, int, node_layout_t> friend class btree_reverse_iterator_t;
 
   public:
-    header() {
-      mtx = new std::mutex();
-      
-      pthread_spin_init(&slock,0);
+    header_t() {
+      lock_word = 0;
+      low_key = Key();
+      appends = 0;
 
-      records = new entry[cardinality];
 			first_index = 0;
 			num_valid_key = 0;
 			leftmost_ptr = nullptr;  
 			right_sibling_ptr = nullptr;
 			is_deleted = false;
     }
-
-    ~header() {
-      delete mtx;
-      delete records; 
-      
-    }
 };
 
+// Key comparison kernel used by SIMD_SEARCH, picked once at startup.
+enum simd_level_t { SIMD_SCALAR = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
 
+static simd_level_t detect_simd_level() {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+    return SIMD_AVX512;
+  if(__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  return SIMD_SCALAR;
+}
 
-const int count_in_line = CACHE_LINE_SIZE / sizeof(entry);
+simd_level_t simd_level = detect_simd_level();
 
-class page{
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class page_t{
   private:
-    header hdr;  // header in persistent memory, 16 bytes
+    typedef Key entry_key_t;
+    typedef entry_t<Key> entry;
+    typedef header_t<Key, Value, Cardinality, Layout> header;
+    typedef page_t<Key, Value, Cardinality, Layout> page;
+    typedef btree_t<Key, Value, Cardinality, Layout> btree;
+    typedef typename btree::path_t path_t;
+    typedef typename records_t<Key, Cardinality, Layout>::reference slot;
+    static const int cardinality = Cardinality;
+
+    header hdr;  // header in persistent memory, 64 bytes
+    records_t<Key, Cardinality, Layout> records; // slots in persistent memory, 16 bytes * n
+
+    static_assert(sizeof(header) == CACHE_LINE_SIZE, "header must fit in one cache line");
 
   public:
-    friend class btree;
+    template <typename, typename, int, node_layout_t> friend class btree_t;
+    template <typename, typename, int, node_layout_t> friend class btree_iterator_t;
+    template <typename, typename, int, node_layout_t> friend class btree_reverse_iterator_t;
 
-    page(uint32_t level = 0) {
+    page_t(uint32_t level = 0) {
       hdr.level = level;
-      hdr.records[0].ptr = nullptr;
+      records[0].ptr = nullptr;
     }
 
     // this is called when tree grows
-    page(page* left, entry_key_t key, page* right, uint32_t level = 0) {
+    page_t(page* left, entry_key_t key, page* right, uint32_t level = 0) {
       hdr.leftmost_ptr = left;  
       hdr.level = level;
-      hdr.records[0].key = key;
-      hdr.records[0].ptr = (char*) right;
-      hdr.records[1].ptr = nullptr;
+      records[0].key = key;
+      records[0].ptr = (char*) right;
+      records[1].ptr = nullptr;
 
       hdr.first_index = 0;
 			hdr.num_valid_key = 1;
@@ -219,10 +669,61 @@ class page{
       return ret;
     }
 
+    void operator delete(void *ptr) {
+      free(ptr);
+    }
+
+    // Flush a node built in place by bulk_load, whose entries do not wrap
+    void flush_node() {
+      clflush((char *)&hdr, sizeof(header));
+      records.flush(hdr.first_index, hdr.num_valid_key);
+    }
+
     inline int count() {
       return hdr.num_valid_key;
     }
 
+    // One word per node locks it and versions it. Bit 0 is the writer lock,
+    // taken by insert, delete and update alike. The bits above count
+    // modifications seqlock-style: a writer holding the lock makes the count
+    // odd before changing the node and even afterwards, lookups run without
+    // locks and retry when the count moved.
+    inline void lock() {
+      uint64_t w;
+      for(;;) {
+        w = __atomic_load_n(&hdr.lock_word, __ATOMIC_RELAXED);
+        if(!(w & 1) && __atomic_compare_exchange_n(&hdr.lock_word, &w, w | 1,
+              false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+          return;
+        _mm_pause();
+      }
+    }
+
+    inline void unlock() {
+      __atomic_fetch_and(&hdr.lock_word, ~1UL, __ATOMIC_RELEASE);
+    }
+
+    inline void write_begin() {
+      __atomic_fetch_add(&hdr.lock_word, 2, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    inline void write_end() {
+      __atomic_fetch_add(&hdr.lock_word, 2, __ATOMIC_RELEASE);
+    }
+
+    inline uint64_t read_begin() {
+      uint64_t w;
+      while((w = __atomic_load_n(&hdr.lock_word, __ATOMIC_ACQUIRE)) & 2)
+        _mm_pause();
+      return w & ~1UL;
+    }
+
+    inline bool read_retry(uint64_t v) {
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      return (__atomic_load_n(&hdr.lock_word, __ATOMIC_RELAXED) & ~1UL) != v;
+    }
+
     inline int get_last_idx(){
 			return (hdr.first_index + hdr.num_valid_key - 1) & (cardinality - 1);
 		}
@@ -241,63 +742,54 @@ class page{
 			bool shift = false;
 			bool is_left = false;
 			int i;
+			entry_key_t removed = entry_key_t();
+
+			// the slots of an empty node hold keys retired before
+			if(hdr.num_valid_key == 0)
+				return false;
 
 			register int m = (hdr.first_index+(int)ceil(hdr.num_valid_key>>1)) & (cardinality - 1);
 			
-			if (key < hdr.records[m].key){ // deletion in left part
+			if (key < records[m].key){ // deletion in left part
 				for(i = (hdr.num_valid_key >> 1) - 1; i>=0; --i) {
 					uint32_t idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
 					// TODO: something wrong about leftmost_ptr
-					if(!shift && hdr.records[idx].key == key) {
+					if(!shift && records[idx].key == key) {
 						// the key in the first_position is going to be removed.
-						hdr.records[idx].ptr = (idx == hdr.first_index ) ? 
-							(char *)hdr.leftmost_ptr : hdr.records[(idx-1) & (cardinality - 1)].ptr;
+						removed = records[idx].key;
+						records[idx].ptr = (idx == hdr.first_index ) ? 
+							(char *)hdr.leftmost_ptr : records[(idx-1) & (cardinality - 1)].ptr;
 						shift = true;
 						is_left = true;
 					}
 
 					if(shift) {
 						int prev_idx = get_index(idx-1);
-						hdr.records[idx].key = (idx==hdr.first_index) ? hdr.records[idx].key : hdr.records[prev_idx].key;
-						hdr.records[idx].ptr = (idx==hdr.first_index)? nullptr : hdr.records[prev_idx].ptr;
+						records[idx].key = (idx==hdr.first_index) ? records[idx].key : records[prev_idx].key;
+						records[idx].ptr = (idx==hdr.first_index)? nullptr : records[prev_idx].ptr;
 
 						// flush
-						uint64_t records_ptr = (uint64_t)(&hdr.records[idx]);
-						int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-						//Q: how??
-						bool do_flush = (remainder == 0) || 
-							((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) && 
-							 ((remainder + sizeof(entry)) & (CACHE_LINE_SIZE - 1)) != 0);
-						if(do_flush) {
-							clflush((char *)records_ptr, CACHE_LINE_SIZE);
-						}
+						records.flush_if_opens_line(idx);
 					}
 				}
 			}else{ // del in right part
 				for(i = (hdr.num_valid_key) >> 1; i < hdr.num_valid_key; ++i) {
 					uint32_t idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-					if(!shift && hdr.records[idx].key == key) {
+					if(!shift && records[idx].key == key) {
 						// the key in the first_position is going to be removed.
-						hdr.records[idx].ptr = (idx == hdr.first_index ) ? 
-							(char *)hdr.leftmost_ptr : hdr.records[(idx-1) & (cardinality - 1)].ptr; 
+						removed = records[idx].key;
+						records[idx].ptr = (idx == hdr.first_index ) ? 
+							(char *)hdr.leftmost_ptr : records[(idx-1) & (cardinality - 1)].ptr; 
 						shift = true;
 					}
 
 					if(shift) {
 						int next_idx = get_index(idx + 1);
-						hdr.records[idx].key = (idx==last_index)? hdr.records[idx].key : hdr.records[next_idx].key;
-						hdr.records[idx].ptr = (idx==last_index)? nullptr : hdr.records[next_idx].ptr;
+						records[idx].key = (idx==last_index)? records[idx].key : records[next_idx].key;
+						records[idx].ptr = (idx==last_index)? nullptr : records[next_idx].ptr;
 
 						// flush
-						uint64_t records_ptr = (uint64_t)(&hdr.records[idx]);
-						int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-						//Q: how??
-						bool do_flush = (remainder == 0) || 
-							((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) && 
-							 ((remainder + sizeof(entry)) & (CACHE_LINE_SIZE - 1)) != 0);
-						if(do_flush) {
-							clflush((char *)records_ptr, CACHE_LINE_SIZE);
-						}
+						records.flush_if_opens_line(idx);
 					}
 				}
 			}
@@ -308,321 +800,177 @@ class page{
 					hdr.first_index = (hdr.first_index + 1) & (cardinality - 1);
 					clflush((char *)&(hdr.first_index), sizeof(uint32_t));
 				} 
+				// a separator that goes away is freed by the merge dropping it
+				if(hdr.leftmost_ptr == nullptr)
+					free_key(removed);
 			}
 			return shift;
     }
 
-    bool remove(btree* bt, entry_key_t key, bool only_rebalance = false, bool with_lock = true) {
-      hdr.mtx->lock();
-      // pthread_spin_lock(&hdr.slock);
-
-      bool ret = remove_key(key);
-
-      // pthread_spin_unlock(&hdr.slock);
-      hdr.mtx->unlock();
-
-      return ret;
-    }
-
-    /*
-     * Although we implemented the rebalancing of B+-Tree, it is currently blocked for the performance.
-     * Please refer to the follow.
-     * Chi, P., Lee, W. C., & Xie, Y. (2014, August). 
-     * Making B+-tree efficient in PCM-based main memory. In Proceedings of the 2014
-     * international symposium on Low power electronics and design (pp. 69-74). ACM.
-     */
-    bool remove_rebalancing(btree* bt, entry_key_t key, bool only_rebalance = false, bool with_lock = true) {
-      if(with_lock) {
-        hdr.mtx->lock();
-      }
+    // Remove key from this leaf, or from the right sibling a split moved
+    // it to, and return the leaf it was looked for in. A leaf merged away
+    // since the descent returns nullptr, the caller then looks it up again.
+    page *remove(entry_key_t key, bool *found) {
+      lock();
       if(hdr.is_deleted) {
-        if(with_lock) {
-          hdr.mtx->unlock();
-        }
-        return false;
+        unlock();
+        return nullptr;
       }
-      if(!only_rebalance) {
-        register int num_entries_before = count();
-
-        // This node is root
-        if(this == (page *)bt->root) {
-          if(hdr.level > 0) {
-            if(num_entries_before == 1 && !hdr.right_sibling_ptr) {
-              bt->root = (char *)hdr.leftmost_ptr;
-              clflush((char *)&(bt->root), sizeof(char *));
-
-              hdr.is_deleted = 1;
-            }
-          }
-
-          // Remove the key from this node
-          bool ret = remove_key(key);
-
-          if(with_lock) {
-            hdr.mtx->unlock();
-          }
-          return true;
-        }
-
-        bool should_rebalance = true;
-        // check the node utilization
-        if(num_entries_before - 1 >= (int)((cardinality - 1) * 0.5)) { 
-          should_rebalance = false;
-        }
-
-        // Remove the key from this node
-        bool ret = remove_key(key);
-
-        if(!should_rebalance) {
-          if(with_lock) {
-            hdr.mtx->unlock();
-          }
-          return (hdr.leftmost_ptr == NULL) ? ret : true;
-        }
-      } 
-
-      //Remove a key from the parent node
-      entry_key_t deleted_key_from_parent = 0;
-      bool is_leftmost_node = false;
-      page *left_sibling = nullptr;
-      page* left_left_sibling = nullptr;
-			// return true;
-			bt->btree_delete_internal(key, (char *)this, hdr.level + 1,
-					&deleted_key_from_parent, &is_leftmost_node, &left_sibling, &left_left_sibling);
-
-      if(is_leftmost_node) {
-        if(with_lock) {
-          hdr.mtx->unlock();
-        }
-
-        if(!with_lock) {
-          hdr.right_sibling_ptr->hdr.mtx->lock();
-        }
-        hdr.right_sibling_ptr->remove(bt, hdr.right_sibling_ptr->hdr.records[hdr.right_sibling_ptr->hdr.first_index].key, true,
-						with_lock);
-        if(!with_lock) {
-          hdr.right_sibling_ptr->hdr.mtx->unlock();
-        }
-        return true;
+      page *t = hdr.right_sibling_ptr;
+      if(t && t->takes(key)) {
+        unlock();
+        return t->remove(key, found);
       }
+      write_begin();
+      *found = remove_key(key);
+      write_end();
+      unlock();
+      return this;
+    }
 
-      if(with_lock) {
-        left_sibling->hdr.mtx->lock();
+    // Take in the entries of right, the next child of the same parent
+    // under the separator key, behind those of this node; an internal node
+    // gets key with right's leftmost child in front of them. The caller
+    // holds the locks of both and of the parent, whose entry for right it
+    // removes next. right keeps its entries for the readers still in it
+    // and is only marked deleted.
+    void absorb(page *right, entry_key_t key) {
+      entry_key_t keys[cardinality];
+      char *ptrs[cardinality];
+      int num = 0;
+      if(hdr.leftmost_ptr != nullptr) {
+        keys[num] = key;
+        ptrs[num++] = (char *)right->hdr.leftmost_ptr;
       }
-
-      while(left_sibling->hdr.right_sibling_ptr != this) {
-        if(with_lock) {
-          page *t = left_sibling->hdr.right_sibling_ptr;
-          left_sibling->hdr.mtx->unlock();
-          left_sibling = t;
-          left_sibling->hdr.mtx->lock();
-        }
-        else
-          left_sibling = left_sibling->hdr.right_sibling_ptr;
+      for(int i = 0; i < right->count(); ++i) {
+        int idx = right->get_index(right->hdr.first_index + i);
+        keys[num] = right->records[idx].key;
+        ptrs[num++] = right->records[idx].ptr;
       }
 
-      register int num_entries = count();
-      register int left_num_entries = left_sibling->count();
-
-      // Merge or Redistribution
-      int total_num_entries = num_entries + left_num_entries;
-      if(hdr.leftmost_ptr)
-        ++total_num_entries;
-
-      entry_key_t parent_key;
-
-      
-      if (left_num_entries < (int)((cardinality-1) *0.5) && num_entries < (int)((cardinality-1) *0.5)){
-        left_sibling->hdr.is_deleted = 1;
-        clflush((char *)&(left_sibling->hdr.is_deleted), sizeof(uint8_t));
-				clflush((char *)&(left_sibling->hdr.is_deleted), sizeof(uint8_t));
-				if(left_sibling->hdr.leftmost_ptr)
-					insert_key(deleted_key_from_parent, 
-							(char *)hdr.leftmost_ptr, &left_num_entries);
-				
-
-
-				for(int i = 0; i < left_sibling->hdr.num_valid_key; ++i) {
-					int idx = (left_sibling->hdr.first_index + i) & (cardinality - 1); 
-					insert_key(left_sibling->hdr.records[idx].key, left_sibling->hdr.records[idx].ptr, &num_entries);
-				}
-
-				
-				if (left_left_sibling != nullptr){
-					left_left_sibling->hdr.right_sibling_ptr = this;
-					clflush((char *)&(left_left_sibling->hdr.right_sibling_ptr), sizeof(page *));	
-				}
-      }
-      if(with_lock) {
-        left_sibling->hdr.mtx->unlock();
-        hdr.mtx->unlock();
-      }
-      // TODO: delete
-      return true;
+      // the moved keys are no inserts, the split policy does not see them
+      uint16_t appends = hdr.appends;
+      write_begin();
+      insert_sorted(keys, ptrs, num);
+      hdr.appends = appends;
+      hdr.right_sibling_ptr = right->hdr.right_sibling_ptr;
+      clflush((char *)&hdr.right_sibling_ptr, sizeof(page *));
+      write_end();
+
+      right->write_begin();
+      right->hdr.is_deleted = 1;
+      clflush((char *)&right->hdr.is_deleted, sizeof(uint16_t));
+      right->write_end();
     }
 
     inline void 
       insert_key(entry_key_t key, char* ptr, int *num_entries, bool flush = true,
           bool update_last_index = true) {
         bool is_left = false;
+        flush_set fs;
 				if(*num_entries == 0) {  // this page is empty
-					entry* new_entry = (entry*) &hdr.records[0];
-					entry* array_end = (entry*) &hdr.records[1];
-					new_entry->key = (entry_key_t) key;
-					new_entry->ptr = (char*) ptr;
+					records[0].key = (entry_key_t) key;
+					records[0].ptr = (char*) ptr;
 
-					array_end->ptr = (char*)nullptr;
+					records[1].ptr = (char*)nullptr;
 					hdr.first_index = 0;
 
 					if(flush) { // FIXME -- wangc@2020.03.08
-						clflush((char*) this, CACHE_LINE_SIZE);
+						fs.add((char*) &hdr, sizeof(header));
+						records.add(fs, 0);
 					}
 				}
 				else {
 					// TODO: wired here. Have to know the usage of these code.
 					int i = *num_entries - 1, inserted = 0;
 
-					if (hdr.leftmost_ptr != nullptr){
-						for (i = *num_entries-1; i>=0; i--){
-							if (key < hdr.records[i].key){
-								hdr.records[i+1].ptr = hdr.records[i].ptr;
-								hdr.records[i+1].key = hdr.records[i].key;
-								if(flush) {
-									uint64_t records_ptr = (uint64_t)(&hdr.records[i+1]);
-
-									int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-									bool do_flush = (remainder == 0) || 
-										((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
-										 && ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
-									if(do_flush) {
-										clflush((char*)(&records_ptr),CACHE_LINE_SIZE);
-									}
-								}
-							}else{
-								hdr.records[i+1].ptr = hdr.records[i].ptr;
-								hdr.records[i+1].key = key;
-								hdr.records[i+1].ptr = ptr;
+					// circle tree insertion, used by leaf and internal nodes alike.
+					// Pairs (key, ptr) are shifted as a whole, so the child on the
+					// right of every separator and the leftmost_ptr are preserved.
+
+					// shift the left part
+					// FIXME, do not use division like "*num_entries / 2". It is slow. Replace with bit shift. -- wangc@2020.03.08
+					if (key < records[(hdr.first_index + (*num_entries >> 1)) & (cardinality - 1)].key){
+						// insert in the left part
+						// copy the leftmost_ptr first.
+						// FIXME, avoid 0.5 in code. Use integers. -- wangc@2020.03.08
+						for(i = 0; i<(*num_entries >> 1); i++){
+							int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
+							if (key > records[idx].key){
+								int insert_idx = (idx - 1) & (cardinality - 1);
 								if(flush)
-                	clflush((char*)&hdr.records[i+1],sizeof(entry));
-								inserted = 1;
+									records.store(fs, insert_idx);
+								records[insert_idx].ptr = records[idx].ptr;
+								records[insert_idx].key = records[idx].key;
+							} else {
 								break;
 							}
-						}
-						if(inserted==0){
-							hdr.records[0].ptr =(char*) hdr.leftmost_ptr;
-							hdr.records[0].key = key;
-							hdr.records[0].ptr = ptr;
-							if(flush)
-								clflush((char*) &hdr.records[0], sizeof(entry)); 
-							hdr.first_index = 0;
-						}
-					}else{
-						// circle tree insertion
-
-						// shift the left part
-						// FIXME, do not use division like "*num_entries / 2". It is slow. Replace with bit shift. -- wangc@2020.03.08
-						if (key < hdr.records[(hdr.first_index + (*num_entries >> 1)) & (cardinality - 1)].key){
-							// insert in the left part
-							// copy the leftmost_ptr first.
-							// FIXME, avoid 0.5 in code. Use integers. -- wangc@2020.03.08
-							for(i = 0; i<(*num_entries >> 1); i++){
-								int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-								if (key > hdr.records[idx].key){
-									int insert_idx = (idx - 1) & (cardinality - 1);
-									hdr.records[insert_idx].ptr = hdr.records[idx].ptr;
-									hdr.records[insert_idx].key = hdr.records[idx].key;
-									// flush the cacheline if A[idx] is at the start of a cache line;
-									if(flush) {
-										uint64_t records_ptr = (uint64_t)(&hdr.records[idx]);
-
-										int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-										bool do_flush = (remainder == 0) || 
-											((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
-											&& ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
-										if(do_flush) {
-											clflush((char*)(&hdr.records[insert_idx]),CACHE_LINE_SIZE);
-										}
-									}
-								} else {
-									break;
-								}
-							}// end for
-							// insert the key and ptr to new position
-							int insert_idx = (hdr.first_index + i - 1) & (cardinality - 1);
-							hdr.records[insert_idx].key = key;
-							hdr.records[insert_idx].ptr = ptr;
-							if(flush)
-								clflush((char*)&hdr.records[insert_idx], sizeof(entry));
-							is_left = true;
-							inserted = 1;
-							// TODO: update b_node, flush b_node;
-						}else{  // shift the right part
-							// copy the rightmost ptr firstly.
-
-							for(i = *num_entries - 1; i>=(*num_entries >> 1); i--){
-								int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-								if (key < hdr.records[idx].key){
-									int insert_idx = (idx + 1) & (cardinality - 1);
-									hdr.records[insert_idx].ptr = hdr.records[idx].ptr;
-									hdr.records[insert_idx].key = hdr.records[idx].key;
-									// flush the cacheline if A[idx] is at the start of a cache line;
-									if(flush) {
-										uint64_t records_ptr = (uint64_t)(&hdr.records[insert_idx]);
-
-										int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-										bool do_flush = (remainder == 0) || 
-											((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
-											&& ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
-										if(do_flush) {
-											clflush((char*)(&hdr.records[insert_idx]),CACHE_LINE_SIZE);
-										
-										}
-									}
-								}else{
-									break;
-								}
-							}// end for
-							// insert the key and ptr to new position
-							int insert_idx = (hdr.first_index + i + 1) & (cardinality - 1);
-							hdr.records[insert_idx].key = key;
-							hdr.records[insert_idx].ptr = ptr;
-							inserted = 1;
-							if(flush)
-								clflush((char*)&hdr.records[insert_idx],sizeof(entry));
-							// TODO: update b_node, flush b_node;
-						}
-						if(inserted==0){
-							hdr.records[0].ptr =(char*) hdr.leftmost_ptr;
-							hdr.records[0].key = key;
-							hdr.records[0].ptr = ptr;
-							if(flush)
-								clflush((char*) &hdr.records[0], sizeof(entry)); 
-							hdr.first_index = 0;
-						}
+						}// end for
+						// insert the key and ptr to new position
+						int insert_idx = (hdr.first_index + i - 1) & (cardinality - 1);
+						if(flush)
+							records.store(fs, insert_idx);
+						records[insert_idx].key = key;
+						records[insert_idx].ptr = ptr;
+						is_left = true;
+						inserted = 1;
+						// TODO: update b_node, flush b_node;
+					}else{  // shift the right part
+						// copy the rightmost ptr firstly.
+
+						for(i = *num_entries - 1; i>=(*num_entries >> 1); i--){
+							int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
+							if (key < records[idx].key){
+								int insert_idx = (idx + 1) & (cardinality - 1);
+								if(flush)
+									records.store(fs, insert_idx);
+								records[insert_idx].ptr = records[idx].ptr;
+								records[insert_idx].key = records[idx].key;
+							}else{
+								break;
+							}
+						}// end for
+						// insert the key and ptr to new position
+						int insert_idx = (hdr.first_index + i + 1) & (cardinality - 1);
+						if(flush)
+							records.store(fs, insert_idx);
+						records[insert_idx].key = key;
+						records[insert_idx].ptr = ptr;
+						inserted = 1;
+						// TODO: update b_node, flush b_node;
+					}
+					if(inserted==0){
+						records[0].ptr =(char*) hdr.leftmost_ptr;
+						if(flush)
+							records.store(fs, 0);
+						records[0].key = key;
+						records[0].ptr = ptr;
+						hdr.first_index = 0;
 					}
 				}
 
+				// the header is published only after the entries it covers
+				if(flush)
+					fs.store((char *)&hdr, sizeof(header));
 				++(*num_entries);
 				// important   TODO: colision here?
 				++hdr.num_valid_key;
-				if (is_left){
-          hdr.first_index = (hdr.first_index - 1) & (cardinality - 1);
-          clflush((char *)&(hdr.first_index), sizeof(uint32_t));
-        } 
+				if (is_left)
+					hdr.first_index = (hdr.first_index - 1) & (cardinality - 1);
+				if(flush)
+					fs.persist();
       }
 
     // Insert a new key - FAST and FAIR
     page *store
       (btree* bt, char* left, entry_key_t key, char* right,
-       bool flush, bool with_lock, page *invalid_sibling = nullptr) {
+       bool flush, bool with_lock, page *invalid_sibling = nullptr, path_t *path = nullptr) {
         if(with_lock) {
-          // hdr.mtx->lock(); // Lock the write lock
-          pthread_spin_lock(&hdr.slock);
+          lock();
         }
         if(hdr.is_deleted) {
           if(with_lock) {
-            // hdr.mtx->unlock();
-            pthread_spin_unlock(&hdr.slock);
+            unlock();
 
           }
 
@@ -632,27 +980,29 @@ class page{
         // If this node has a sibling node,
         if(hdr.right_sibling_ptr && (hdr.right_sibling_ptr != invalid_sibling)) {
           // Compare this key with the first key of the sibling
-          if(key > hdr.right_sibling_ptr->hdr.records[0].key) {
+          if(hdr.right_sibling_ptr->takes(key)) {
             if(with_lock) { 
-              // hdr.mtx->unlock(); // Unlock the write lock
-              // hdr.slock->unlock();
-              pthread_spin_unlock(&hdr.slock);
+              unlock();
             }
             return hdr.right_sibling_ptr->store(bt, nullptr, key, right, 
-                true, with_lock, invalid_sibling);
+                true, with_lock, invalid_sibling, path);
           }
         }
 
         register int num_entries = count();
+        bool append = count_append(key);
+        // the leaf slot keeps a copy of the key, a separator is the parent's
+        if(hdr.leftmost_ptr == nullptr)
+          key = spill_key(key);
 
+        write_begin();
         // FAST
         if(num_entries < cardinality - 1) {
           insert_key(key, right, &num_entries, flush);
 
+          write_end();
           if(with_lock) {
-            // hdr.mtx->unlock(); // Unlock the write lock
-            // hdr.slock->unlock();
-            pthread_spin_unlock(&hdr.slock);
+            unlock();
           }
 
           return this;
@@ -661,8 +1011,14 @@ class page{
           // overflow
           // create a new node
           page* sibling = new page(hdr.level); 
-          register int m = (hdr.first_index+(int)ceil(num_entries/2)) & (cardinality - 1);
-          entry_key_t split_key = hdr.records[m].key;
+          int left_num = (int)ceil(num_entries/2);
+          if(append && (bt->split_policy == SPLIT_APPEND ||
+                (bt->split_policy == SPLIT_ADAPTIVE && hdr.appends >= APPEND_RUN)))
+            left_num = num_entries - std::max(2, num_entries / APPEND_SPLIT);
+          register int m = (hdr.first_index+left_num) & (cardinality - 1);
+          // a leaf key moved up is copied, the one of an internal node moves
+          entry_key_t split_key = (hdr.leftmost_ptr == nullptr) ?
+            spill_key(records[m].key) : records[m].key;
 
           // migrate half of keys into the sibling
           int sibling_cnt = 0;
@@ -671,35 +1027,41 @@ class page{
           if (hdr.leftmost_ptr == nullptr) { // leaf node
 						for (int i=0; i<=move_num; ++i) {
 							int idx = get_index(m + i); 
-							sibling->insert_key(hdr.records[idx].key, hdr.records[idx].ptr, &sibling_cnt, false);
+							sibling->insert_key(records[idx].key, records[idx].ptr, &sibling_cnt, false);
 							// MARK
-              hdr.records[idx].ptr = nullptr;
-						//	hdr.records[idx].key = nullptr;
+              records[idx].ptr = nullptr;
+						//	records[idx].key = nullptr;
 						}
 					}
 					else{ // internal node
 						for(int i=1;i<=move_num;++i){ 
 							int idx = get_index(m + i);
-							sibling->insert_key(hdr.records[idx].key, hdr.records[idx].ptr, &sibling_cnt, false);
-							hdr.records[idx].ptr = nullptr;
-						//	hdr.records[idx].key = nullptr;
+							sibling->insert_key(records[idx].key, records[idx].ptr, &sibling_cnt, false);
+							records[idx].ptr = nullptr;
+						//	records[idx].key = nullptr;
 						}
 						// TODO: have to do with the leftmost_ptr
-						sibling->hdr.leftmost_ptr = (page*) hdr.records[m].ptr;
+						sibling->hdr.leftmost_ptr = (page*) records[m].ptr;
 					}
 
           sibling->hdr.right_sibling_ptr = hdr.right_sibling_ptr;
-          clflush((char *)sibling, sizeof(page));
+          sibling->hdr.low_key = split_key;
+          sibling->hdr.appends = hdr.appends;
+          clflush((char *)&sibling->hdr, sizeof(header));
+          sibling->records.flush(0, sibling_cnt);
 
           hdr.right_sibling_ptr = sibling;
           clflush((char*) &hdr, sizeof(hdr));
 
           
-          hdr.records[m].ptr = nullptr;
-          clflush((char*) &hdr.records[m], sizeof(entry));
-
-          hdr.num_valid_key -= sibling_cnt;
-					clflush((char *)&(hdr.num_valid_key), sizeof(uint32_t));
+          records[m].ptr = nullptr;
+          // the separator at m moves up to the parent, an internal node drops it
+          hdr.num_valid_key -= (hdr.leftmost_ptr == nullptr) ? sibling_cnt : sibling_cnt + 1;
+          // both stores only shrink this node, they share one fence
+          flush_set fs;
+          records.add(fs, m);
+          fs.add((char *)&(hdr.num_valid_key), sizeof(uint32_t));
+          fs.persist();
 
           num_entries = hdr.num_valid_key;
 
@@ -711,9 +1073,17 @@ class page{
             ret = this;
           }
           else {
+            // the sibling is reachable now, other writers may have found it
+            if(with_lock)
+              sibling->lock();
+            sibling->write_begin();
             sibling->insert_key(key, right, &sibling_cnt);
+            sibling->write_end();
+            if(with_lock)
+              sibling->unlock();
             ret = sibling;
           }
+          write_end();
 
           // Set a new root or insert the split key to the parent
           if(bt->root == (char *)this) { // only one node can update the root ptr
@@ -722,32 +1092,159 @@ class page{
             bt->setNewRoot((char *)new_root);
 
             if(with_lock) {
-              // hdr.mtx->unlock(); // Unlock the write lock
-              // hdr.slock->unlock();
-              pthread_spin_unlock(&hdr.slock);
+              unlock();
             }
           }
           else {
             if(with_lock) {
-              // hdr.mtx->unlock(); // Unlock the write lock
-              // hdr.slock->unlock();
-              pthread_spin_unlock(&hdr.slock);
+              unlock();
             }
             bt->btree_insert_internal(nullptr, split_key, (char *)sibling, 
-                hdr.level + 1);
+                hdr.level + 1, path);
           }
-
           return ret;
         }
 
       }
 
-    // Search keys with linear search
-    void linear_search_range
-      (entry_key_t min, entry_key_t max, unsigned long *buf) {
-        return;
+    // Copy the entries of a leaf whose keys are not less than min (greater
+    // than min if after is set), in logical order, and return how many
+    // there are, the right sibling and the node version the copy is
+    // consistent with
+    int linear_search_range
+      (entry_key_t min, bool after, entry_key_t *keys, char **values, page **sibling,
+       uint64_t *version) {
+        int num, lo;
+        uint64_t v;
+        do {
+          v = read_begin();
+          num = count();
+          lo = lower_bound(min, after);
+          for(int i = lo; i < num; ++i) {
+            keys[i - lo] = records[get_index(hdr.first_index + i)].key;
+            values[i - lo] = records[get_index(hdr.first_index + i)].ptr;
+          }
+          *sibling = hdr.right_sibling_ptr;
+        } while(read_retry(v));
+        *version = v;
+        return num - lo;
       }
 
+    // True if a key reaching the left sibling has moved here, i.e. it is at
+    // least the separator this node was split off at. The first key is no
+    // such fence, deletes raise it above the separator the parent routes by.
+    inline bool takes(entry_key_t key) {
+      return !(key < hdr.low_key);
+    }
+
+    // Child of an internal node a descent of key takes and the separator
+    // left of it, as of one version. The right sibling comes back instead,
+    // with *right set and no separator, if key has moved there.
+    inline page *fenced_child(entry_key_t key, bool *right, entry_key_t *low, bool *has_low) {
+      page *ret;
+      uint64_t v;
+      do {
+        v = read_begin();
+        page *t = hdr.right_sibling_ptr;
+        *right = t != nullptr && t->takes(key);
+        *has_low = false;
+        if(*right)
+          ret = t;
+        else {
+          int pos = lower_bound(key, true);
+          if(pos > 0) {
+            *low = records[get_index(hdr.first_index + pos - 1)].key;
+            *has_low = true;
+          }
+          ret = (pos > 0) ? (page *)records[get_index(hdr.first_index + pos - 1)].ptr
+            : hdr.leftmost_ptr;
+        }
+      } while(read_retry(v));
+      return ret;
+    }
+
+    // Whether ptr is a child of this internal node, called with the lock held
+    bool has_child(char *ptr) {
+      if((char *)hdr.leftmost_ptr == ptr)
+        return true;
+      for(int i = 0; i < count(); ++i)
+        if(records[get_index(hdr.first_index + i)].ptr == ptr)
+          return true;
+      return false;
+    }
+
+    // Number of keys less than (or, if inclusive, not greater than) key,
+    // i.e. the logical index of the first one that is not. Callers
+    // validate the node version.
+    inline int lower_bound(entry_key_t key, bool inclusive = false) {
+      int lo = 0, len = count();
+      if(len > cardinality)
+        len = cardinality;
+      while(len > 0) {
+        int half = len >> 1;
+        entry_key_t k = records[get_index(hdr.first_index + lo + half)].key;
+        if(inclusive ? !(key < k) : k < key) {
+          lo += half + 1;
+          len -= half + 1;
+        }
+        else
+          len = half;
+      }
+      return lo;
+    }
+
+    // Copy the entries of a leaf whose keys are less than max, from the
+    // last one backwards, and return how many there are along with the
+    // node version the copy is consistent with
+    int reverse_search_range
+      (entry_key_t max, entry_key_t *keys, char **values, uint64_t *version) {
+        int hi;
+        uint64_t v;
+        do {
+          v = read_begin();
+          hi = lower_bound(max);
+          for(int i = hi - 1; i >= 0; --i) {
+            keys[hi - 1 - i] = records[get_index(hdr.first_index + i)].key;
+            values[hi - 1 - i] = records[get_index(hdr.first_index + i)].ptr;
+          }
+        } while(read_retry(v));
+        *version = v;
+        return hi;
+      }
+
+    // Next node on the way to the largest key less than max: the child
+    // covering it, or the right sibling when a split moved it there. When
+    // the step is bounded from below, *fence receives the separator all of
+    // its keys are at least. A leaf that holds max's range returns nullptr
+    // and the version it does so in.
+    page *search_below(entry_key_t max, entry_key_t *fence, bool *bounded, uint64_t *version) {
+      page *next;
+      uint64_t v;
+      do {
+        v = read_begin();
+        page *t = hdr.right_sibling_ptr;
+        *bounded = false;
+        next = nullptr;
+        if(t && max > t->hdr.low_key) {
+          next = t;
+          *fence = t->hdr.low_key;
+          *bounded = true;
+        }
+        else if(hdr.leftmost_ptr != nullptr) {
+          int c = lower_bound(max) - 1;
+          if(c < 0)
+            next = hdr.leftmost_ptr;
+          else {
+            next = (page *)records[get_index(hdr.first_index + c)].ptr;
+            *fence = records[get_index(hdr.first_index + c)].key;
+            *bounded = true;
+          }
+        }
+      } while(read_retry(v));
+      *version = v;
+      return next;
+    }
+
     char *linear_search(entry_key_t key) {
                                 int i = 1;
                                 char *ret = nullptr;
@@ -756,38 +1253,38 @@ class page{
 
                                 if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
                                         for (i = 0; i < count(); ++i)
-                                                if (key == hdr.records[(hdr.first_index + i) & (cardinality - 1)].key) {
-                                                        ret = hdr.records[(hdr.first_index + i) & (cardinality - 1)].ptr;
+                                                if (key == records[(hdr.first_index + i) & (cardinality - 1)].key) {
+                                                        ret = records[(hdr.first_index + i) & (cardinality - 1)].ptr;
                                                         break;
                                                 }
                                         if(ret) {
                                                 return ret;
                                         }
-                                        if((t = (char *)hdr.right_sibling_ptr) != nullptr && key >= ((page *)t)->hdr.records[(((page *)t)->hdr).first_index].key)
+                                        if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
                                                 return t;
 
                                         return nullptr;
                                 }
-                                else { // internal node, which you do not have circular design. -- wangc@2020.03.22
+                                else { // internal node, circular like the leaves
                                         ret = nullptr;
 
-                                        if(key < (k = hdr.records[0].key)) {
+                                        if(key < (k = records[hdr.first_index].key)) {
                                                 ret = (char *)hdr.leftmost_ptr;
                                         } else {
 
                                                 for(i = 1; i < count(); ++i) {
-                                                        if(key < (k = hdr.records[i].key)) {
-                                                                ret = hdr.records[i - 1].ptr;
+                                                        if(key < (k = records[get_index(hdr.first_index + i)].key)) {
+                                                                ret = records[get_index(hdr.first_index + i - 1)].ptr;
                                                                 break;
                                                         }
                                                 }
 
                                                 if(!ret) {
-                                                        ret = hdr.records[i - 1].ptr;
+                                                        ret = records[get_index(hdr.first_index + i - 1)].ptr;
                                                 }
                                         }
                                         if ((t = (char *)hdr.right_sibling_ptr) != nullptr) {
-                                                if(key >= ((page *)t)->hdr.records[0].key)
+                                                if(((page *)t)->takes(key))
                                                         return t;
                                         }
 
@@ -801,6 +1298,318 @@ class page{
                                 return nullptr;
                         }
 
+    // Search keys with a branchless binary search over the logical index
+    // (first_index + i) & (cardinality - 1), i.e. the circular array is
+    // treated as a rotated sorted array.
+    char *binary_search(entry_key_t key) {
+      int num = count();
+      int first = hdr.first_index;
+      int lo = 0, len = num;
+      char *t;
+
+      if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
+        // lower bound: first slot whose key is not less than the key
+        while(len > 1) {
+          int half = len >> 1;
+          // prefetch the probes of both possible next steps
+          records.prefetch(get_index(first + lo + (len >> 2) - 1));
+          records.prefetch(get_index(first + lo + half + (len >> 2) - 1));
+          lo += (records[get_index(first + lo + half - 1)].key < key) ? half : 0;
+          len -= half;
+        }
+        if(num > 0) {
+          lo += (records[get_index(first + lo)].key < key);
+          if(lo < num && records[get_index(first + lo)].key == key)
+            return records[get_index(first + lo)].ptr;
+        }
+
+        if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+          return t;
+
+        return nullptr;
+      }
+      else { // internal node
+        // upper bound: number of separators not greater than the key
+        while(len > 1) {
+          int half = len >> 1;
+          // prefetch the probes of both possible next steps
+          records.prefetch(get_index(first + lo + (len >> 2) - 1));
+          records.prefetch(get_index(first + lo + half + (len >> 2) - 1));
+          lo += (records[get_index(first + lo + half - 1)].key <= key) ? half : 0;
+          len -= half;
+        }
+        if(num > 0)
+          lo += (records[get_index(first + lo)].key <= key);
+
+        if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+          return t;
+
+        if(lo == 0 || records[get_index(first + lo - 1)].ptr == nullptr)
+          return (char *)hdr.leftmost_ptr;
+        return records[get_index(first + lo - 1)].ptr;
+      }
+    }
+
+    // Count the slots of a contiguous run of n entries whose key is less
+    // than (or, if inclusive, not greater than) the key. The run is sorted,
+    // so the count is the position of the key inside the run. A run is
+    // an array of entries or, with NODE_SOA, of keys.
+    static inline const entry_key_t &key_of(const entry &e) { return e.key; }
+    static inline const entry_key_t &key_of(const entry_key_t &k) { return k; }
+
+    template <typename T>
+    static int run_rank_scalar(T *e, int n, entry_key_t key, bool inclusive) {
+      int i = 0;
+      if(inclusive) {
+        while(i < n && key_of(e[i]) <= key) ++i;
+      }
+      else {
+        while(i < n && key_of(e[i]) < key) ++i;
+      }
+      return i;
+    }
+
+    // 4 keys per compare. Two 32-byte loads cover 4 entries and unpacklo
+    // gathers their keys as k0 k2 k1 k3, which does not matter for counting.
+    __attribute__((target("avx2")))
+    static int run_rank_avx2(entry *e, int n, entry_key_t key, bool inclusive) {
+      __m256i kv = _mm256_set1_epi64x(key);
+      int i = 0, cnt = 0;
+      for(; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((__m256i *)&e[i]);
+        __m256i b = _mm256_loadu_si256((__m256i *)&e[i + 2]);
+        __m256i keys = _mm256_unpacklo_epi64(a, b);
+        __m256i hit = inclusive ?
+          _mm256_xor_si256(_mm256_cmpgt_epi64(keys, kv), _mm256_set1_epi64x(-1)) :
+          _mm256_cmpgt_epi64(kv, keys);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+        cnt += __builtin_popcount(mask);
+        if(mask != 0xF)
+          return cnt;
+      }
+      return cnt + run_rank_scalar(e + i, n - i, key, inclusive);
+    }
+
+    __attribute__((target("avx2")))
+    static int run_rank_avx2(entry_key_t *k, int n, entry_key_t key, bool inclusive) {
+      __m256i kv = _mm256_set1_epi64x(key);
+      int i = 0, cnt = 0;
+      for(; i + 4 <= n; i += 4) {
+        __m256i keys = _mm256_loadu_si256((__m256i *)&k[i]);
+        __m256i hit = inclusive ?
+          _mm256_xor_si256(_mm256_cmpgt_epi64(keys, kv), _mm256_set1_epi64x(-1)) :
+          _mm256_cmpgt_epi64(kv, keys);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+        cnt += __builtin_popcount(mask);
+        if(mask != 0xF)
+          return cnt;
+      }
+      return cnt + run_rank_scalar(k + i, n - i, key, inclusive);
+    }
+
+    // 8 keys per compare, the keys of two 64-byte loads are gathered with
+    // one permute.
+    __attribute__((target("avx512f")))
+    static int run_rank_avx512(entry *e, int n, entry_key_t key, bool inclusive) {
+      const __m512i key_idx = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+      __m512i kv = _mm512_set1_epi64(key);
+      int i = 0, cnt = 0;
+      for(; i + 8 <= n; i += 8) {
+        __m512i a = _mm512_loadu_si512((void *)&e[i]);
+        __m512i b = _mm512_loadu_si512((void *)&e[i + 4]);
+        __m512i keys = _mm512_permutex2var_epi64(a, key_idx, b);
+        __mmask8 mask = inclusive ? _mm512_cmple_epi64_mask(keys, kv) :
+          _mm512_cmplt_epi64_mask(keys, kv);
+        cnt += __builtin_popcount(mask);
+        if(mask != 0xFF)
+          return cnt;
+      }
+      return cnt + run_rank_avx2(e + i, n - i, key, inclusive);
+    }
+
+    __attribute__((target("avx512f")))
+    static int run_rank_avx512(entry_key_t *k, int n, entry_key_t key, bool inclusive) {
+      __m512i kv = _mm512_set1_epi64(key);
+      int i = 0, cnt = 0;
+      for(; i + 8 <= n; i += 8) {
+        __m512i keys = _mm512_loadu_si512((void *)&k[i]);
+        __mmask8 mask = inclusive ? _mm512_cmple_epi64_mask(keys, kv) :
+          _mm512_cmplt_epi64_mask(keys, kv);
+        cnt += __builtin_popcount(mask);
+        if(mask != 0xFF)
+          return cnt;
+      }
+      return cnt + run_rank_avx2(k + i, n - i, key, inclusive);
+    }
+
+    // the kernels compare 64-bit signed keys, other key types are counted
+    // by the scalar loop
+    template <typename T>
+    static inline int run_rank(T *e, int n, entry_key_t key, bool inclusive) {
+      return run_rank(e, n, key, inclusive, std::integral_constant<bool,
+          std::is_integral<entry_key_t>::value && std::is_signed<entry_key_t>::value &&
+          sizeof(entry_key_t) == 8>());
+    }
+
+    template <typename T>
+    static inline int run_rank(T *e, int n, entry_key_t key, bool inclusive, std::false_type) {
+      return run_rank_scalar(e, n, key, inclusive);
+    }
+
+    template <typename T>
+    static inline int run_rank(T *e, int n, entry_key_t key, bool inclusive, std::true_type) {
+      switch(simd_level) {
+        case SIMD_AVX512:
+          return run_rank_avx512(e, n, key, inclusive);
+        case SIMD_AVX2:
+          return run_rank_avx2(e, n, key, inclusive);
+        default:
+          return run_rank_scalar(e, n, key, inclusive);
+      }
+    }
+
+    // Position of the key in the logical order of this node. The circular
+    // array is searched as at most two contiguous runs split at the wrap
+    // point.
+    inline int rank(entry_key_t key, bool inclusive) {
+      int num = count();
+      int first = hdr.first_index;
+      int run = (num < cardinality - first) ? num : cardinality - first;
+      int pos = run_rank(records.run(first), run, key, inclusive);
+      if(pos == run && num > run)
+        pos += run_rank(records.run(0), num - run, key, inclusive);
+      return pos;
+    }
+
+    // Search keys with the vectorized comparison kernel
+    char *simd_search(entry_key_t key) {
+      int first = hdr.first_index;
+      int pos;
+      char *t;
+
+      if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
+        pos = rank(key, false);
+        if(pos < count() && records[get_index(first + pos)].key == key)
+          return records[get_index(first + pos)].ptr;
+
+        if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+          return t;
+
+        return nullptr;
+      }
+      else { // internal node
+        pos = rank(key, true);
+
+        if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+          return t;
+
+        if(pos == 0 || records[get_index(first + pos - 1)].ptr == nullptr)
+          return (char *)hdr.leftmost_ptr;
+        return records[get_index(first + pos - 1)].ptr;
+      }
+    }
+
+    // Write back the slots at logical [from, to) from first_index, the
+    // fence is left to the caller
+    void flush_slots(int from, int to) {
+      char *last[2] = {nullptr, nullptr};
+      if(flush_insn == FLUSH_CLFLUSH)
+        mfence();
+      for(int i = from; i < to; ++i)
+        records.write_back(get_index(hdr.first_index + i), last);
+    }
+
+    // Count an insert of key in hdr.appends: one among the last
+    // 1/APPEND_SPLIT of the keys is an append, anything else halves the run
+    inline bool count_append(entry_key_t key) {
+      int num = count();
+      bool append = num == 0 || key > records[get_index(hdr.first_index + num - 1 -
+          num / APPEND_SPLIT)].key;
+      hdr.appends = append ? (hdr.appends < APPEND_RUN ? hdr.appends + 1 : APPEND_RUN) :
+        hdr.appends >> 1;
+      return append;
+    }
+
+    // Insert num sorted keys that all belong to this node and fit in it.
+    // The keys below the first entry and above the last one go to the free
+    // slots in front of and behind the entries, where they stay unreachable
+    // until the header takes them in: one fence covers those slots, another
+    // the header. A bulk merge among the entries would overwrite slots the
+    // old header still points at, so the keys falling between entries are
+    // shifted in one at a time by insert_key.
+    void insert_sorted(entry_key_t *keys, char **values, int num) {
+      // the batch counts as the single inserts it replaces
+      for(int i = 0; i < num; ++i)
+        count_append(keys[i]);
+
+      int cnt = count();
+      int front = 0, back = num;
+      if(cnt > 0) {
+        while(front < num && keys[front] < records[hdr.first_index].key)
+          ++front;
+        while(back > front && keys[back - 1] > records[get_last_idx()].key)
+          --back;
+      }
+      else
+        back = 0;
+
+      for(int i = 0; i < front; ++i) {
+        slot e = records[get_index(hdr.first_index - front + i)];
+        e.key = keys[i];
+        e.ptr = values[i];
+      }
+      for(int i = back; i < num; ++i) {
+        slot e = records[get_index(hdr.first_index + cnt + i - back)];
+        e.key = keys[i];
+        e.ptr = values[i];
+      }
+      if(front > 0 || back < num) {
+        flush_slots(-front, 0);
+        flush_slots(cnt, cnt + num - back);
+        persist_fence();
+
+        hdr.num_valid_key += front + num - back;
+        hdr.first_index = get_index(hdr.first_index - front);
+        clflush((char *)&hdr, sizeof(header));
+      }
+
+      for(int i = front; i < back; ++i) {
+        int n = count();
+        insert_key(keys[i], values[i], &n);
+      }
+    }
+
+// Prefetch the slots a search of this node starts from, once the
+    // header is in the cache
+    inline void prefetch_records() {
+      int num = count();
+      int first = hdr.first_index;
+      records.prefetch(first);
+      records.prefetch(get_index(first + (num >> 2)));
+      records.prefetch(get_index(first + (num >> 1)));
+      records.prefetch(get_index(first + num - (num >> 2)));
+    }
+
+    inline char *search(entry_key_t key, search_mode_t mode) {
+      char *ret;
+      uint64_t v;
+      do {
+        v = read_begin();
+        switch(mode) {
+          case BINARY_SEARCH:
+            ret = binary_search(key);
+            break;
+          case SIMD_SEARCH:
+            ret = simd_search(key);
+            break;
+          default:
+            ret = linear_search(key);
+            break;
+        }
+      } while(read_retry(v));
+      return ret;
+    }
+
     // print a node 
     void print() {
       if(hdr.leftmost_ptr == nullptr) 
@@ -817,8 +1626,10 @@ class page{
 
       for(int i=0; i < hdr.num_valid_key;++i){
         int idx = get_index(hdr.first_index + i);
-        printf("K:%ld, ", hdr.records[idx].key);
-        printf("V:%x. ",hdr.records[idx].ptr);
+        printf("K:");
+        print_key(records[idx].key);
+        printf(", ");
+        printf("V:%x. ",records[idx].ptr);
       }
         
 			printf("\n");
@@ -838,205 +1649,887 @@ class page{
         ((page*) hdr.leftmost_ptr)->printAll();
         for(int i=0;i < hdr.num_valid_key;++i){
           int idx = get_index(hdr.first_index + i);
-          ((page*) hdr.records[idx].ptr)->printAll();
+          ((page*) records[idx].ptr)->printAll();
         }
       }
     }
 };
 
+// Epoch-based reclamation of unlinked nodes. Every tree operation runs in
+// an epoch_guard that publishes the global epoch it started in. A node
+// retired in epoch e is freed once the global epoch reaches e + 2: the
+// epoch only advances when every thread inside the tree has seen it, so by
+// then no operation that could still hold the node is running.
+#define MAX_EPOCH_THREADS 256
+#define EPOCH_RECLAIM_BATCH 64
+
+struct alignas(CACHE_LINE_SIZE) epoch_slot {
+  uint64_t epoch;   // epoch entered, 0 while the thread is outside the tree
+  uint32_t in_use;
+};
+
+struct retired_page {
+  void *node;
+  void (*free_node)(void *);
+  size_t size;
+  uint64_t epoch;
+};
+
+epoch_slot epoch_slots[MAX_EPOCH_THREADS];
+int epoch_max_slot = 0;
+uint64_t global_epoch = 1;
+uint64_t epoch_retired_bytes = 0;
+uint64_t epoch_freed_bytes = 0;
+std::mutex orphan_mtx;
+std::vector<retired_page> orphan_pages;  // left behind by exited threads
+
+class epoch_thread {
+  public:
+    int slot;
+    int nesting;
+    std::vector<retired_page> retired;
+
+    epoch_thread() {
+      nesting = 0;
+      for(slot = 0; ; slot = (slot + 1) % MAX_EPOCH_THREADS) {
+        uint32_t expected = 0;
+        if(__atomic_compare_exchange_n(&epoch_slots[slot].in_use, &expected, 1,
+              false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+          break;
+      }
+      int m = __atomic_load_n(&epoch_max_slot, __ATOMIC_RELAXED);
+      while(m < slot + 1 && !__atomic_compare_exchange_n(&epoch_max_slot, &m, slot + 1,
+            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    ~epoch_thread() {
+      if(!retired.empty()) {
+        std::lock_guard<std::mutex> guard(orphan_mtx);
+        orphan_pages.insert(orphan_pages.end(), retired.begin(), retired.end());
+      }
+      __atomic_store_n(&epoch_slots[slot].in_use, 0, __ATOMIC_RELEASE);
+    }
+};
+
+thread_local epoch_thread epoch_local;
+
+inline void epoch_enter() {
+  epoch_thread &t = epoch_local;
+  if(t.nesting++ > 0)
+    return;
+  uint64_t e;
+  do {
+    e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&epoch_slots[t.slot].epoch, e, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } while(__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) != e);
+}
+
+inline void epoch_exit() {
+  epoch_thread &t = epoch_local;
+  if(--t.nesting == 0)
+    __atomic_store_n(&epoch_slots[t.slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Epoch the calling thread is in, inside an epoch_guard. Nothing it could
+// reach in that epoch is freed before it moves to another one.
+inline uint64_t epoch_pinned() {
+  return __atomic_load_n(&epoch_slots[epoch_local.slot].epoch, __ATOMIC_RELAXED);
+}
+
+class epoch_guard {
+  public:
+    epoch_guard() { epoch_enter(); }
+    ~epoch_guard() { epoch_exit(); }
+};
+
+// Move the global epoch forward if every thread inside the tree has seen it
+inline uint64_t epoch_try_advance() {
+  uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  int n = __atomic_load_n(&epoch_max_slot, __ATOMIC_RELAXED);
+  for(int i = 0; i < n; ++i) {
+    uint64_t s = __atomic_load_n(&epoch_slots[i].epoch, __ATOMIC_ACQUIRE);
+    if(s != 0 && s != e)
+      return e;
+  }
+  __atomic_compare_exchange_n(&global_epoch, &e, e + 1, false,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+}
+
+inline void epoch_free(std::vector<retired_page> &pages, uint64_t safe_epoch) {
+  size_t kept = 0;
+  for(size_t i = 0; i < pages.size(); ++i) {
+    if(pages[i].epoch + 2 <= safe_epoch) {
+      pages[i].free_node(pages[i].node);
+      __atomic_fetch_add(&epoch_freed_bytes, pages[i].size, __ATOMIC_RELAXED);
+    }
+    else
+      pages[kept++] = pages[i];
+  }
+  pages.resize(kept);
+}
+
+inline void epoch_reclaim() {
+  uint64_t e = epoch_try_advance();
+  epoch_free(epoch_local.retired, e);
+  std::unique_lock<std::mutex> guard(orphan_mtx, std::try_to_lock);
+  if(guard.owns_lock())
+    epoch_free(orphan_pages, e);
+}
+
+// Free everything retired so far, called while no thread is inside a tree,
+// e.g. by a driver between two phases
+inline void epoch_reclaim_all() {
+  epoch_try_advance();
+  uint64_t e = epoch_try_advance();
+  epoch_free(epoch_local.retired, e);
+  std::lock_guard<std::mutex> guard(orphan_mtx);
+  epoch_free(orphan_pages, e);
+}
+
+template <typename T>
+static void epoch_delete(void *node) {
+  delete (T *)node;
+}
+
+// Hand size bytes at node to free_node once no reader can hold them
+inline void epoch_retire_raw(void *node, void (*free_node)(void *), size_t size) {
+  epoch_thread &t = epoch_local;
+  retired_page r;
+  r.node = node;
+  r.free_node = free_node;
+  r.size = size;
+  r.epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  t.retired.push_back(r);
+  __atomic_fetch_add(&epoch_retired_bytes, size, __ATOMIC_RELAXED);
+  if(t.retired.size() >= EPOCH_RECLAIM_BATCH)
+    epoch_reclaim();
+}
+
+template <typename T>
+void epoch_retire(T *node) {
+  epoch_retire_raw(node, epoch_delete<T>, sizeof(T));
+}
+
+/*
+ * class btree_iterator
+ */
+// Forward scan in key order: seek() positions the iterator at the first key
+// not less than the given one, next() steps through the following keys
+// across right_sibling_ptr. The entries of one leaf are copied out at a
+// time under its version, and the next leaf is prefetched while they are
+// consumed. Stepping off a leaf that changed since the copy reads it again
+// from the last key returned, so keys moved right by a split are not
+// skipped. The iterator stays in the epoch until it is destroyed and must
+// be used by the thread that created it.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class btree_iterator_t{
+  private:
+    typedef Key entry_key_t;
+    typedef page_t<Key, Value, Cardinality, Layout> page;
+    typedef btree_t<Key, Value, Cardinality, Layout> btree;
+    static const int cardinality = Cardinality;
+    static const int count_in_line = records_t<Key, Cardinality, Layout>::per_line;
+
+    epoch_guard guard;
+    btree *bt;
+    page *leaf;     // leaf the buffered entries were copied from
+    page *sibling;  // its right sibling when they were copied
+    uint64_t version;
+    int pos, num;
+    entry_key_t keys[cardinality];
+    char *values[cardinality];
+
+    void descend(entry_key_t key);
+    void fill(entry_key_t min, bool after);
+
+  public:
+    btree_iterator_t(btree *bt) : bt(bt), leaf(nullptr), sibling(nullptr), pos(0), num(0) {}
+    btree_iterator_t(const btree_iterator_t &) = delete;
+    btree_iterator_t &operator=(const btree_iterator_t &) = delete;
+    void seek(entry_key_t key);
+    void next();
+    bool valid() { return pos < num; }
+    entry_key_t key() { return keys[pos]; }
+    Value value() { return (Value)values[pos]; }
+};
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_iterator_t<Key, Value, Cardinality, Layout>::descend(entry_key_t key) {
+  page *p = (page *)bt->root;
+  while(p->hdr.leftmost_ptr != nullptr)
+    p = (page *)p->search(key, bt->search_mode);
+  leaf = p;
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_iterator_t<Key, Value, Cardinality, Layout>::seek(entry_key_t key) {
+  descend(key);
+  fill(key, false);
+}
+
+// Buffer the keys not less than min, or greater than min if after is set,
+// starting at the current leaf and moving right past leaves that hold none
+// of them. A leaf merged away sends the search back to the root.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_iterator_t<Key, Value, Cardinality, Layout>::fill(entry_key_t min, bool after) {
+  pos = num = 0;
+  while(leaf) {
+    num = leaf->linear_search_range(min, after, keys, values, &sibling, &version);
+    if(leaf->hdr.is_deleted) {
+      descend(min);
+      continue;
+    }
+    if(sibling)
+      __builtin_prefetch(sibling);
+    if(num > 0)
+      return;
+    leaf = sibling;
+  }
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_iterator_t<Key, Value, Cardinality, Layout>::next() {
+  if(++pos < num) {
+    // the header is in by now, fetch the first entries of the next leaf
+    if(pos == (num >> 1) && sibling) {
+      for(int i = 0; i < 4; ++i)
+        sibling->records.prefetch_slot(sibling->get_index(
+              sibling->hdr.first_index + i * count_in_line));
+    }
+    return;
+  }
+  if(keys[num - 1] == std::numeric_limits<entry_key_t>::max())
+    return;
+  if(!leaf->read_retry(version))
+    leaf = sibling;
+  fill(keys[num - 1], true);
+}
+
+/*
+ * class btree_reverse_iterator
+ */
+// Backward scan in key order: seek() positions the iterator at the last key
+// less than the given one, next() steps to smaller keys. Leaves only link
+// to the right and a cached path would go stale under concurrent splits,
+// so the previous leaf is found by one descent per leaf towards the lower
+// fence of the current one, the separator its keys are known to be at
+// least. Each leaf is read backwards from its last logical index under its
+// version; a leaf that changed before it was left is read again below the
+// last key returned. The iterator stays in the epoch until it is destroyed
+// and must be used by the thread that created it.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class btree_reverse_iterator_t{
+  private:
+    typedef Key entry_key_t;
+    typedef page_t<Key, Value, Cardinality, Layout> page;
+    typedef btree_t<Key, Value, Cardinality, Layout> btree;
+    static const int cardinality = Cardinality;
+
+    epoch_guard guard;
+    btree *bt;
+    page *leaf;
+    uint64_t version;
+    entry_key_t fence;  // every key of the leaf is at least fence
+    bool bounded;       // false for the leftmost leaf
+    int pos, num;
+    entry_key_t keys[cardinality];
+    char *values[cardinality];
+
+    void fill(entry_key_t max);
+
+  public:
+    btree_reverse_iterator_t(btree *bt) : bt(bt), leaf(nullptr), bounded(false), pos(0), num(0) {}
+    btree_reverse_iterator_t(const btree_reverse_iterator_t &) = delete;
+    btree_reverse_iterator_t &operator=(const btree_reverse_iterator_t &) = delete;
+    void seek(entry_key_t key) { fill(key); }
+    void next();
+    bool valid() { return pos < num; }
+    entry_key_t key() { return keys[pos]; }
+    Value value() { return (Value)values[pos]; }
+};
+
+// Buffer the keys less than max from the leaf holding the largest of them,
+// descending again below the fence of leaves that hold none. The leaf is
+// read in the version it was found to hold max's range in, a split in
+// between sends the search on from it.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_reverse_iterator_t<Key, Value, Cardinality, Layout>::fill(entry_key_t max) {
+  pos = num = 0;
+  for(;;) {
+    page *p = (page *)bt->root, *next;
+    entry_key_t f;
+    bool b;
+    uint64_t v;
+    bounded = false;
+    for(;;) {
+      while((next = p->search_below(max, &f, &b, &v)) != nullptr) {
+        if(b) {
+          fence = f;
+          bounded = true;
+        }
+        p = next;
+      }
+      num = p->reverse_search_range(max, keys, values, &version);
+      if(version == v)
+        break;
+    }
+    leaf = p;
+    if(num > 0 || !bounded)
+      return;
+    max = fence;
+  }
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_reverse_iterator_t<Key, Value, Cardinality, Layout>::next() {
+  if(++pos < num)
+    return;
+  if(leaf->read_retry(version))
+    fill(keys[num - 1]);
+  else if(bounded)
+    fill(fence);
+}
+
 /*
  * class btree
  */
-btree::btree(){
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+btree_t<Key, Value, Cardinality, Layout>::btree_t(search_mode_t mode){
+  search_mode = mode;
+  split_policy = SPLIT_ADAPTIVE;
+  use_finger = false;
   root = (char*)new page();
   height = 1;
 }
 
-void btree::setNewRoot(char *new_root) {
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+thread_local typename btree_t<Key, Value, Cardinality, Layout>::finger_t
+btree_t<Key, Value, Cardinality, Layout>::finger;
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::setNewRoot(char *new_root) {
   this->root = (char*)new_root;
   clflush((char*)&(this->root),sizeof(char*));
   ++height;
 }
 
-char *btree::btree_search(entry_key_t key){
-  page* p = (page*)root;
+// Take the high fence of the finger's leaf from the low key of its right
+// sibling, as of one version of the leaf. Every split, merge or deletion
+// of the leaf writes under that version. False if the leaf is gone.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+bool btree_t<Key, Value, Cardinality, Layout>::finger_fence(finger_t &f) {
+  page *p = f.leaf;
+  uint64_t v = p->read_begin();
+  bool deleted = p->hdr.is_deleted;
+  page *t = p->hdr.right_sibling_ptr;
+  entry_key_t high = t ? t->hdr.low_key : entry_key_t();
+  if(p->read_retry(v) || deleted)
+    return false;
+  f.version = v;
+  f.has_high = (t != nullptr);
+  f.high = high;
+  return true;
+}
+
+// Leaf key belongs to, called inside an epoch_guard. The leaf of the
+// thread's finger is taken while the thread is in the epoch the finger was
+// set in, so its pages are not freed, and key lies between the fences of
+// the leaf, which are read again once its version moved. Otherwise a
+// descent from the root finds the leaf and its low fence, unless it had to
+// move right on the way. A leaf that splits after the check still sends
+// the key right like it does for a racing descent.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+typename btree_t<Key, Value, Cardinality, Layout>::page *
+btree_t<Key, Value, Cardinality, Layout>::finger_leaf(entry_key_t key) {
+  finger_t &f = finger;
+  uint64_t e = epoch_pinned();
+  if(f.tree == this && f.epoch == e &&
+      (f.leaf->read_begin() == f.version || finger_fence(f)) &&
+      (!f.has_low || !(key < f.low)) && (!f.has_high || key < f.high))
+    return f.leaf;
 
+  page *p = (page *)root;
+  bool moved = false;
+  f.tree = nullptr;
+  f.has_low = false;
+  f.path.start(p);
   while(p->hdr.leftmost_ptr != nullptr) {
-    p = (page *)p->linear_search(key);
+    f.path.visit(p);
+    entry_key_t low = entry_key_t();
+    bool has_low, right;
+    p = p->fenced_child(key, &right, &low, &has_low);
+    moved |= right;
+    // a level below only narrows the range a level above left
+    if(has_low) {
+      f.low = low;
+      f.has_low = true;
+    }
+  }
+  f.leaf = p;
+  if(!moved && finger_fence(f)) {
+    f.tree = this;
+    f.epoch = e;
+  }
+  return p;
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+Value btree_t<Key, Value, Cardinality, Layout>::btree_search(entry_key_t key){
+  epoch_guard guard;
+  page* p;
+
+  if(use_finger)
+    p = finger_leaf(key);
+  else {
+    p = (page*)root;
+    while(p->hdr.leftmost_ptr != nullptr) {
+      p = (page *)p->search(key, search_mode);
+    }
   }
 
   page *t;
-  while((t = (page *)p->linear_search(key)) == p->hdr.right_sibling_ptr) {
+  while((t = (page *)p->search(key, search_mode)) == p->hdr.right_sibling_ptr) {
     p = t;
     if(!p) {
       break;
     }
   }
 
-  if(!t || (char *)t != (char *)key) {
-    printf("NOT FOUND %lu, t = %x\n", key, t);
-    return nullptr;
+  if(!t) {
+    printf("NOT FOUND ");
+    print_key(key);
+    printf("\n");
+    return Value();
   }
 
-  return (char *)t;
+  return (Value)(char *)t;
+}
+
+#define MULTI_GET_GROUP 16
+
+// Look up n keys, out[i] receives what btree_search(keys[i]) returns
+// without the message for missing keys. The keys go down in groups level
+// by level: every lookup of a group takes its step in a node prefetched
+// the round before and prefetches the next one, so the misses of the
+// group overlap instead of following each other.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::multi_get(entry_key_t *keys, int n, Value *out) {
+  epoch_guard guard;
+  page *nodes[MULTI_GET_GROUP];
+
+  for(int base = 0; base < n; base += MULTI_GET_GROUP) {
+    int g = (n - base < MULTI_GET_GROUP) ? n - base : MULTI_GET_GROUP;
+    entry_key_t *k = keys + base;
+    page *r = (page *)root;
+    for(int i = 0; i < g; ++i)
+      nodes[i] = r;
+
+    bool internal = r->hdr.leftmost_ptr != nullptr;
+    while(internal) {
+      internal = false;
+      for(int i = 0; i < g; ++i) {
+        if(nodes[i]->hdr.leftmost_ptr == nullptr)
+          continue;
+        nodes[i] = (page *)nodes[i]->search(k[i], search_mode);
+        __builtin_prefetch(nodes[i]);
+        internal = true;
+      }
+      // the headers are on their way, fetch the slots behind them
+      for(int i = 0; i < g; ++i)
+        nodes[i]->prefetch_records();
+    }
+
+    for(int i = 0; i < g; ++i) {
+      page *p = nodes[i], *t;
+      while((t = (page *)p->search(k[i], search_mode)) == p->hdr.right_sibling_ptr) {
+        p = t;
+        if(!p)
+          break;
+      }
+      out[base + i] = (Value)(char *)t;
+    }
+  }
 }
 
 // insert the key in the leaf node
-void btree::btree_insert(entry_key_t key, char* right){ //need to be string
-  page* p = (page*)root;
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_insert(entry_key_t key, Value right){ //need to be string
+  epoch_guard guard;
+  page* p;
+  path_t path, *parents = &path;
+
+  do {
+    if(use_finger) {
+      p = finger_leaf(key);
+      parents = &finger.path;
+    }
+    else {
+      p = (page*)root;
+      path.start(p);
+      while(p->hdr.leftmost_ptr != nullptr) {
+        path.visit(p);
+        p = (page*)p->search(key, search_mode);
+      }
+    }
+  } while(!p->store(this, nullptr, key, (char *)right, true, true, nullptr, parents)); // store 
+}
 
-  while(p->hdr.leftmost_ptr != nullptr) {
-    p = (page*)p->linear_search(key);
+// Insert a batch of n keys. The batch is sorted, and every leaf it lands
+// in is reached and locked once and takes all of its keys that fit with
+// one insert_sorted. A full leaf gets the next key through btree_insert,
+// which splits it, and the rest of its keys on the next pass.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::multi_put(entry_key_t *keys, Value *values, int n) {
+  epoch_guard guard;
+  std::vector<std::pair<entry_key_t, char *> > batch(n);
+  for(int i = 0; i < n; ++i)
+    batch[i] = std::make_pair(keys[i], (char *)values[i]);
+  std::sort(batch.begin(), batch.end());
+
+  entry_key_t run_keys[cardinality];
+  char *run_values[cardinality];
+  for(int i = 0; i < n; ) {
+    entry_key_t key = batch[i].first;
+    page *p = (page *)root;
+    while(p->hdr.leftmost_ptr != nullptr)
+      p = (page *)p->search(key, search_mode);
+
+    // the keys below the lowest key of the right sibling belong here
+    page *sibling;
+    entry_key_t bound;
+    bool bounded;
+    for(;;) {
+      p->lock();
+      sibling = p->hdr.right_sibling_ptr;
+      bounded = sibling != nullptr;
+      if(bounded)
+        bound = sibling->hdr.low_key;
+      if(p->hdr.is_deleted || !bounded || key < bound)
+        break;
+      p->unlock();
+      p = sibling;
+    }
+    if(p->hdr.is_deleted) {
+      p->unlock();
+      continue;
+    }
+
+    int room = cardinality - 1 - p->count();
+    int num = 0;
+    for(; num < room && i + num < n && (!bounded || batch[i + num].first < bound); ++num) {
+      run_keys[num] = spill_key(batch[i + num].first);
+      run_values[num] = batch[i + num].second;
+    }
+
+    if(num == 0) {
+      p->unlock();
+      btree_insert(key, (Value)batch[i].second);
+      ++i;
+      continue;
+    }
+    p->write_begin();
+    p->insert_sorted(run_keys, run_values, num);
+    p->write_end();
+    p->unlock();
+    i += num;
+  }
+}
+
+// Run fn(from, to) over [0, num) split into contiguous ranges, one per thread
+template <typename Fn>
+static void parallel_ranges(long num, int n_threads, Fn fn) {
+  if(n_threads > num)
+    n_threads = num;
+  if(n_threads <= 1) {
+    fn(0L, num);
+    return;
+  }
+  std::vector<std::future<void> > futures;
+  for(int t = 0; t < n_threads; ++t)
+    futures.push_back(std::async(std::launch::async, fn,
+          num * t / n_threads, num * (t + 1) / n_threads));
+  for(auto &&f : futures)
+    f.get();
+}
+
+// Start of the i-th of num groups when total items are spread evenly
+static inline long bulk_group_start(long i, long total, long num) {
+  return i * (total / num) + (i < total % num ? i : total % num);
+}
+
+// Link the nodes of one level built by bulk_load and flush each of them.
+// Every node of the level exists already, so the links across the ranges
+// built by different threads are set like any other.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::bulk_link_level(std::vector<page *> &nodes, int n_threads) {
+  parallel_ranges(nodes.size(), n_threads, [&nodes](long from, long to) {
+      for(long i = from; i < to; ++i) {
+        if(i + 1 < (long)nodes.size())
+          nodes[i]->hdr.right_sibling_ptr = nodes[i + 1];
+        nodes[i]->flush_node();
+      }
+    });
+}
+
+// Build the level above nodes, a parent with k entries covers k + 1
+// children. low_keys holds the smallest key under each node and is
+// replaced by the one of each parent.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+std::vector<page_t<Key, Value, Cardinality, Layout> *> btree_t<Key, Value, Cardinality, Layout>::bulk_build_parents(std::vector<page *> &nodes,
+    std::vector<entry_key_t> &low_keys, uint32_t level, long per_node, int n_threads) {
+  long m = nodes.size();
+  long num_parents = (m + per_node) / (per_node + 1);
+  std::vector<page *> parents(num_parents);
+  std::vector<entry_key_t> parent_keys(num_parents);
+  parallel_ranges(num_parents, n_threads, [&](long from, long to) {
+      for(long i = from; i < to; ++i) {
+        long c = bulk_group_start(i, m, num_parents);
+        int cnt = bulk_group_start(i + 1, m, num_parents) - c - 1;
+        int base = (cardinality - cnt) >> 1;
+        page *node = new page(level);
+        node->hdr.leftmost_ptr = nodes[c];
+        node->hdr.first_index = base;
+        for(int j = 0; j < cnt; ++j) {
+          node->records[base + j].key = low_keys[c + 1 + j];
+          node->records[base + j].ptr = (char *)nodes[c + 1 + j];
+        }
+        node->hdr.num_valid_key = cnt;
+        node->hdr.low_key = low_keys[c];
+        parent_keys[i] = low_keys[c];
+        parents[i] = node;
+      }
+    });
+  bulk_link_level(parents, n_threads);
+  low_keys.swap(parent_keys);
+  return parents;
+}
+
+// Build the tree bottom-up from (key, value) pairs sorted by key. Nodes
+// are filled to fill_factor and their entries are centered in the circular
+// array, so later inserts find room for a shift on either side. Each node
+// is flushed once it is complete, the root pointer last. A tree that
+// already holds keys gets them through btree_insert instead.
+//
+// With n_threads > 1 every level is split into contiguous runs of nodes
+// built by separate threads; the input is partitioned by the leaf each
+// pair lands in.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+template <typename It>
+void btree_t<Key, Value, Cardinality, Layout>::bulk_load(It first, It last, double fill_factor, int n_threads) {
+  page *old_root = (page *)root;
+  if(old_root->count() != 0 || old_root->hdr.leftmost_ptr != nullptr) {
+    for(; first != last; ++first)
+      btree_insert(first->first, first->second);
+    return;
   }
 
-  if(!p->store(this, nullptr, key, right, true, true)) { // store 
-    btree_insert(key, right);
+  long n = std::distance(first, last);
+  if(n == 0)
+    return;
+
+  long per_node = (long)((cardinality - 1) * fill_factor);
+  if(per_node < 2)
+    per_node = 2;
+  if(per_node > cardinality - 1)
+    per_node = cardinality - 1;
+
+  // leaves, with the entries spread evenly over the fewest nodes
+  long num_nodes = (n + per_node - 1) / per_node;
+  std::vector<page *> nodes(num_nodes);
+  std::vector<entry_key_t> low_keys(num_nodes);
+  parallel_ranges(num_nodes, n_threads, [&](long from, long to) {
+      It it = first;
+      std::advance(it, bulk_group_start(from, n, num_nodes));
+      for(long i = from; i < to; ++i) {
+        int cnt = bulk_group_start(i + 1, n, num_nodes) - bulk_group_start(i, n, num_nodes);
+        int base = (cardinality - cnt) >> 1;
+        page *leaf = new page(0);
+        leaf->hdr.first_index = base;
+        for(int j = 0; j < cnt; ++j, ++it) {
+          leaf->records[base + j].key = spill_key(it->first);
+          leaf->records[base + j].ptr = (char *)it->second;
+        }
+        leaf->hdr.num_valid_key = cnt;
+        // the separators above get copies, the leftmost leaf has none
+        if(i > 0)
+          low_keys[i] = leaf->hdr.low_key = spill_key(leaf->records[base].key);
+        nodes[i] = leaf;
+      }
+    });
+  bulk_link_level(nodes, n_threads);
+
+  uint32_t level = 0;
+  while(nodes.size() > 1) {
+    std::vector<page *> parents = bulk_build_parents(nodes, low_keys, ++level, per_node, n_threads);
+    nodes.swap(parents);
   }
+
+  root = (char *)nodes[0];
+  clflush((char *)&root, sizeof(root));
+  height = level + 1;
+  // a reader that loaded the old root may still be searching it, and a
+  // finger holding it takes it for gone
+  old_root->write_begin();
+  old_root->hdr.is_deleted = 1;
+  old_root->write_end();
+  epoch_retire(old_root);
 }
 
-// store the key into the node at the given level 
-void btree::btree_insert_internal
-(char *left, entry_key_t key, char *right, uint32_t level) {
+// store the key into the node at the given level, starting from the one
+// the descent in path passed through if there is one. store() moves right
+// from it if it split since, and fails if it was retired, after which the
+// parent is looked up from the root.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_insert_internal
+(char *left, entry_key_t key, char *right, uint32_t level, path_t *path) {
+  epoch_guard guard;
   if(level > ((page *)root)->hdr.level)
     return;
 
-  page *p = (page *)this->root;
+  page *p = path ? path->at(level) : nullptr;
 
-  while(p->hdr.level > level) 
-    p = (page *)p->linear_search(key);
+  if(!p) {
+    p = (page *)this->root;
+    while(p->hdr.level > level) 
+      p = (page *)p->search(key, search_mode);
+  }
 
-  if(!p->store(this, nullptr, key, right, true, true)) {
+  if(!p->store(this, nullptr, key, right, true, true, nullptr, path)) {
     btree_insert_internal(left, key, right, level);
   }
 }
 
-void btree::btree_delete(entry_key_t key) {
-  page* p = (page*)root;
+// A leaf left less than half full is merged with a neighbour, see
+// btree_delete_internal
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_delete(entry_key_t key) {
+  epoch_guard guard;
+  path_t path;
+  page *p;
+  bool found;
+
+  do {
+    p = (page *)root;
+    path.start(p);
+    while(p->hdr.leftmost_ptr != nullptr) {
+      path.visit(p);
+      p = (page *)p->search(key, search_mode);
+    }
+  } while(!(p = p->remove(key, &found)));
 
-  while(p->hdr.leftmost_ptr != nullptr){
-    p = (page*) p->linear_search(key);
+  if(!found) {
+    printf("not found the key to delete ");
+    print_key(key);
+    printf("\n");
   }
+  else if(p != (page *)root && p->count() < (cardinality - 1) / 2)
+    btree_delete_internal(key, (char *)p, 1, &path);
+}
 
-  page *t;
-  while((t = (page *)p->linear_search(key)) == p->hdr.right_sibling_ptr) {
-    p = t;
-    if(!p)
+// Merge the child ptr of a node at the given level with a neighbour under
+// the same parent if their entries together fill at most three quarters of
+// a node. The right one of the pair moves into the left one, the parent
+// drops its separator and may be merged in turn. The merged node is
+// retired once the parent and its left neighbour no longer point to it.
+// Locks are taken parent first, then left to right, the order splits and
+// moves to a right sibling follow. A parent keeps at least one separator,
+// so the tree never loses a level.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_delete_internal
+(entry_key_t key, char *ptr, uint32_t level, path_t *path) {
+  epoch_guard guard;
+  if(level > ((page *)root)->hdr.level)
+    return;
+
+  // the node the descent passed through, or a right sibling ptr moved to
+  // when it split, is locked as the parent; a retired one or a ptr out of
+  // reach leaves the child as it is
+  page *p = path ? path->at(level) : nullptr;
+  if(!p) {
+    p = (page *)root;
+    while(p->hdr.level > level)
+      p = (page *)p->search(key, search_mode);
+  }
+  while(p) {
+    p->lock();
+    if(!p->hdr.is_deleted && p->has_child(ptr))
       break;
+    page *t = p->hdr.is_deleted ? nullptr : p->hdr.right_sibling_ptr;
+    p->unlock();
+    p = (t && ((char *)t->hdr.leftmost_ptr == ptr || t->takes(key))) ? t : nullptr;
   }
+  if(!p)
+    return;
 
-  if(p) {
-    if(!p->remove(this, key)) {
-      btree_delete(key);
-    }
+  int num = p->count();
+  if(num < 2) {
+    p->unlock();
+    return;
   }
-  else {
-    printf("not found the key to delete %lu\n", key);
+  // logical index of the child's entry, -1 for the leftmost child, and of
+  // the entry of the right node of the pair
+  int pos = -1;
+  if((char *)p->hdr.leftmost_ptr != ptr)
+    while(p->records[p->get_index(p->hdr.first_index + ++pos)].ptr != ptr);
+  int r = (pos + 1 < num) ? pos + 1 : pos;
+  page *left = (r == 0) ? p->hdr.leftmost_ptr :
+    (page *)p->records[p->get_index(p->hdr.first_index + r - 1)].ptr;
+  page *right = (page *)p->records[p->get_index(p->hdr.first_index + r)].ptr;
+  entry_key_t separator = p->records[p->get_index(p->hdr.first_index + r)].key;
+
+  left->lock();
+  right->lock();
+  bool merge = left->hdr.right_sibling_ptr == right &&
+    left->count() + right->count() + (left->hdr.leftmost_ptr ? 1 : 0) <= (cardinality - 1) * 3 / 4;
+  if(merge) {
+    left->absorb(right, separator);
+    p->write_begin();
+    p->remove_key(separator);
+    p->write_end();
   }
-}
-
-void btree::btree_delete_internal
-(entry_key_t key, char *ptr, uint32_t level, entry_key_t *deleted_key, 
- bool *is_leftmost_node, page **left_sibling, page** left_left_sibling) {
-	if(level > ((page *)this->root)->hdr.level)
-		return;
-	
-	page *p = (page*)(this->root);
+  right->unlock();
+  left->unlock();
+  p->unlock();
+  if(!merge)
+    return;
 
-	while(p->hdr.level > level) {
-		p = (page *)p->linear_search(key);
-	}
-	p->hdr.mtx->lock();
-	if((char *)p->hdr.leftmost_ptr == ptr) {
-		*is_leftmost_node = true;
-    p->hdr.mtx->unlock();
-		return;
-	}
-	
-	*is_leftmost_node = false;
-	
-	int last_index = p->get_last_idx();
-	
-	for(int i=0; i < p->hdr.num_valid_key; i++) {
-		int idx = p->get_index(p->hdr.first_index + i);
-		if(p->hdr.records[idx].ptr == ptr) {
-	    if(idx == p->hdr.first_index) {
-				
-				if((char *)p->hdr.leftmost_ptr != p->hdr.records[idx].ptr) {
-					
-					*deleted_key = p->hdr.records[idx].key;
-					page* tmp = (page*)p->hdr.records[idx].ptr;
-					*left_sibling = p->hdr.leftmost_ptr;
-					int num_keys = (tmp)->count();
-					if (((*left_sibling)->count() < (int)((cardinality-1) *0.5) && num_keys < (int)((cardinality-1) *0.5))
-					){
-						
-						p->remove(this, *deleted_key, false, false);
-						// return;
-						p->set_leftmost_ptr(tmp);
-						// if (num_keys == 0) delete tmp;
-					}else if (num_keys == 0){
-						// p->remove(this, *deleted_key, false, false);
-						// delete tmp;
-						// (*left_sibling)->hdr.right_sibling_ptr = nullptr;
-					}
-					break;
-				}
-			}
-			else {
-				int prev_idx = p->get_index(idx - 1);
-				if(p->hdr.records[prev_idx].ptr != p->hdr.records[idx].ptr) {
-					
-					*deleted_key = p->hdr.records[idx].key;
-					*left_sibling = (page *)p->hdr.records[prev_idx].ptr;
-					page* tmp = (page*)p->hdr.records[idx].ptr;
-					
-					if (prev_idx == p->hdr.first_index){
-						*left_left_sibling = p->hdr.leftmost_ptr;
-					}else{
-						*left_left_sibling = (page *)p->hdr.records[p->get_index(prev_idx - 1)].ptr;
-					}
-					int num_keys = (tmp)->count();
-					if (((*left_sibling)->count() < (int)((cardinality-1) *0.5) && num_keys-1 < (int)((cardinality-1) *0.5) )
-					){
-						
-						p->remove(this, *deleted_key, false, false);
-						p->hdr.records[prev_idx].ptr = (char*)tmp;
-						// if (num_keys == 0) delete tmp;
-					}else if (num_keys == 0){
-						// p->remove(this, *deleted_key, false, false);
-						// delete tmp;
-						// (*left_sibling)->hdr.right_sibling_ptr = nullptr;
-					}
-					
-					break;
-				}
-			}
-		}
-	}
-  p->hdr.mtx->unlock();
+  // an internal node took the separator in, between leaves it is gone
+  if(right->hdr.leftmost_ptr == nullptr)
+    free_key(separator);
+  epoch_retire(right);
+  if(p != (page *)root && p->count() < (cardinality - 1) / 2)
+    btree_delete_internal(key, (char *)p, level + 1, path);
 }
 
 
-// Function to search keys from "min" to "max"
-void btree::btree_search_range
-(entry_key_t min, entry_key_t max, unsigned long *buf) {
-  page *p = (page *)root;
-
-  while(p) {
-    if(p->hdr.leftmost_ptr != nullptr) {
-      // The current page is internal
-      p = (page *)p->linear_search(min);
-    }
-    else {
-      // Found a leaf
-      p->linear_search_range(min, max, buf);
+// Store the values of up to limit keys in [min, max) into buf in key
+// order and return how many were found
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+int btree_t<Key, Value, Cardinality, Layout>::btree_search_range
+(entry_key_t min, entry_key_t max, unsigned long *buf, int limit) {
+  btree_iterator it(this);
+  int num = 0;
+  for(it.seek(min); num < limit && it.valid() && it.key() < max; it.next())
+    buf[num++] = (unsigned long)it.value();
+  return num;
+}
 
-      break;
-    }
-  }
+// Store the values of up to limit keys in [min, max) into buf in
+// descending key order and return how many were found
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+int btree_t<Key, Value, Cardinality, Layout>::btree_search_range_reverse
+(entry_key_t min, entry_key_t max, unsigned long *buf, int limit) {
+  btree_reverse_iterator it(this);
+  int num = 0;
+  for(it.seek(max); num < limit && it.valid() && it.key() >= min; it.next())
+    buf[num++] = (unsigned long)it.value();
+  return num;
 }
 
-void btree::printAll(){
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::printAll(){
   pthread_mutex_lock(&print_mtx);
   int total_keys = 0;
 	page *leftmost = (page *)root;
@@ -1059,3 +2552,8 @@ void btree::printAll(){
 	printf("total number of keys: %d\n", total_keys);
   pthread_mutex_unlock(&print_mtx);
 }
+
+// The tree the drivers use, sized by record_size in config.h
+using btree = btree_t<entry_key_t, char *, record_size>;
+using btree_iterator = btree_iterator_t<entry_key_t, char *, record_size>;
+using btree_reverse_iterator = btree_reverse_iterator_t<entry_key_t, char *, record_size>;
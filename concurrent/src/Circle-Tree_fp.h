@@ -24,6 +24,8 @@
 #include <future>
 #include <mutex>
 #include <pthread.h>
+#include <immintrin.h>
+#include <cpuid.h>
 #include"config.h"
 
 // #include <boost/atomic.hpp>
@@ -90,18 +92,64 @@ inline void mfence()
   asm volatile("mfence":::"memory");
 }
 
+// Cache line write-back used by clflush(), picked once at startup from
+// CPUID. Legacy clflush is fenced on both sides; clflushopt and clwb are
+// weakly ordered and only need a single trailing sfence. PM_FLUSH=clflush,
+// clflushopt or clwb overrides the choice for benchmarking.
+enum flush_insn_t {FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB};
+
+static const char *flush_insn_name[] = {"clflush", "clflushopt", "clwb"};
+
+static flush_insn_t detect_flush_insn()
+{
+  unsigned int eax, ebx, ecx, edx;
+  bool supported[3] = {true, false, false};
+  if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+    supported[FLUSH_CLFLUSHOPT] = (ebx >> 23) & 1;
+    supported[FLUSH_CLWB] = (ebx >> 24) & 1;
+  }
+  flush_insn_t insn = supported[FLUSH_CLWB] ? FLUSH_CLWB :
+    (supported[FLUSH_CLFLUSHOPT] ? FLUSH_CLFLUSHOPT : FLUSH_CLFLUSH);
+  const char *env = getenv("PM_FLUSH");
+  if(env){
+    for(int i = 0; i < 3; ++i){
+      if(!strcmp(env, flush_insn_name[i])){
+        if(supported[i]) insn = (flush_insn_t)i;
+        else fprintf(stderr, "PM_FLUSH=%s is not supported by this CPU\n", env);
+      }
+    }
+  }
+  fprintf(stderr, "flush instruction: %s\n", flush_insn_name[insn]);
+  return insn;
+}
+
+flush_insn_t flush_insn = detect_flush_insn();
+
+inline void sfence()
+{
+  asm volatile("sfence":::"memory");
+}
+
 inline void clflush(char *data, int len)
 {
   volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
   for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
     unsigned long etsc = read_tsc() + 
       (unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
-    asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
+    if(flush_insn == FLUSH_CLWB)
+      asm volatile("clwb %0" : "+m" (*(volatile char *)ptr));
+    else if(flush_insn == FLUSH_CLFLUSHOPT)
+      asm volatile("clflushopt %0" : "+m" (*(volatile char *)ptr));
+    else
+      asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
     while (read_tsc() < etsc) cpu_pause();
-    //++clflush_cnt;
   }
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
+  else
+    sfence();
 }
 unsigned char cal_hash(unsigned long x) 
 {
@@ -118,6 +166,20 @@ unsigned char cal_hash(unsigned long x)
 	return (unsigned char) x;
 }
 
+// Fingerprint probing kernel used by the leaf search, picked once at startup.
+enum simd_level_t { SIMD_SCALAR = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
+
+static simd_level_t detect_simd_level() {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512bw"))
+    return SIMD_AVX512;
+  if(__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  return SIMD_SCALAR;
+}
+
+simd_level_t simd_level = detect_simd_level();
+
 class page;
 
 class btree{
@@ -772,6 +834,76 @@ class page{
 
       }
 
+    // Bitmask of the n (<= 64) fingerprints starting at fp that match hash_val
+    static uint64_t fp_match_scalar(unsigned char *fp, int n, unsigned char hash_val) {
+      uint64_t mask = 0;
+      for(int i = 0; i < n; ++i)
+        mask |= (uint64_t)(fp[i] == hash_val) << i;
+      return mask;
+    }
+
+    __attribute__((target("avx2")))
+    static uint64_t fp_match_avx2(unsigned char *fp, unsigned char hash_val) {
+      __m256i hv = _mm256_set1_epi8((char)hash_val);
+      uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)fp), hv));
+      uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(fp + 32)), hv));
+      return ((uint64_t)hi << 32) | lo;
+    }
+
+    __attribute__((target("avx512bw")))
+    static uint64_t fp_match_avx512(unsigned char *fp, unsigned char hash_val) {
+      return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((void *)fp), _mm512_set1_epi8((char)hash_val));
+    }
+
+    static inline uint64_t fp_match(unsigned char *fp, int n, unsigned char hash_val) {
+      if(n == 64) {
+        if(simd_level == SIMD_AVX512)
+          return fp_match_avx512(fp, hash_val);
+        if(simd_level == SIMD_AVX2)
+          return fp_match_avx2(fp, hash_val);
+      }
+      return fp_match_scalar(fp, n, hash_val);
+    }
+
+    // Bits of the physical slots [lo, hi) that fall into [base, base + 64)
+    static inline uint64_t range_mask(int lo, int hi, int base) {
+      lo = (lo > base) ? lo - base : 0;
+      hi = (hi < base + 64) ? hi - base : 64;
+      if(lo >= hi)
+        return 0;
+      uint64_t mask = (hi == 64) ? ~0ULL : ((1ULL << hi) - 1);
+      return mask & ~((1ULL << lo) - 1);
+    }
+
+    // Occupied slots of [base, base + 64): the logical range
+    // [0, num_valid_key) rotated by first_index.
+    inline uint64_t valid_mask(int base, int num) {
+      int first = hdr.first_index;
+      int end = first + num;
+      uint64_t mask = range_mask(first, (end < cardinality) ? end : cardinality, base);
+      if(end > cardinality)
+        mask |= range_mask(0, end - cardinality, base);
+      return mask;
+    }
+
+    // Probe the fingerprints of a leaf 64 slots at a time and only read
+    // the keys of the matching occupied slots.
+    inline char *probe_leaf(entry_key_t key) {
+      unsigned char hash_val = cal_hash(key);
+      int num = count();
+      for(int base = 0; base < cardinality; base += 64) {
+        int n = (cardinality - base < 64) ? cardinality - base : 64;
+        uint64_t cand = fp_match(&hdr.buffer_records[base], n, hash_val) & valid_mask(base, num);
+        while(cand) {
+          int idx = base + __builtin_ctzll(cand);
+          if(key == hdr.records[idx].key)
+            return (char*)hdr.records[idx].ptr;
+          cand &= cand - 1;
+        }
+      }
+      return nullptr;
+    }
+
     // Search keys with linear search
     void linear_search_range
       (entry_key_t min, entry_key_t max, unsigned long *buf) {
@@ -783,17 +915,8 @@ class page{
       char *ret = nullptr;
       char *t;
       entry_key_t k;
-      unsigned char hash_val = cal_hash(key);
       if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
-        for (i = 0; i < count(); ++i){
-          int idx = get_index(hdr.first_index + i);
-          if (hash_val == hdr.buffer_records[idx]) {
-            if (key == hdr.records[idx].key){
-              ret = (char*)hdr.records[idx].ptr;
-              break;
-            }
-          }
-        }	
+        ret = probe_leaf(key);
         if(ret) {
           return ret;
         }
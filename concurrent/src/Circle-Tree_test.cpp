@@ -22,10 +22,17 @@ int main(int argc, char** argv)
     // Parsing arguments
   int numData = 0;
   int n_threads = 1;
+  search_mode_t search_mode = LINEAR_SEARCH;
+  double fill_factor = 0.0;
+  int scan_len = 0;
+  int batch = 0;
+  int put_batch = 0;
+  bool finger = false;
+  bool del = false;
   char *input_path = (char *)std::string("../sample_input.txt").data();
 
   int c;
-  while((c = getopt(argc, argv, "n:w:t:i:")) != -1) {
+  while((c = getopt(argc, argv, "n:w:t:i:bvl:e:g:m:fd")) != -1) {
     switch(c) {
       case 'n':
         numData = atoi(optarg);
@@ -38,13 +45,39 @@ int main(int argc, char** argv)
         break;
       case 'i':
         input_path = optarg;
+        break;
+      case 'b':
+        search_mode = BINARY_SEARCH;
+        break;
+      case 'v':
+        search_mode = SIMD_SEARCH;
+        break;
+      case 'l':
+        fill_factor = atof(optarg);
+        break;
+      case 'e':
+        scan_len = atoi(optarg);
+        break;
+      case 'g':
+        batch = atoi(optarg);
+        break;
+      case 'm':
+        put_batch = atoi(optarg);
+        break;
+      case 'f':
+        finger = true;
+        break;
+      case 'd':
+        del = true;
+        break;
       default:
         break;
     }
   }
 
   btree *bt;
-  bt = new btree();
+  bt = new btree(search_mode);
+  bt->set_finger(finger);
 
   struct timespec start, end,tmp;
 
@@ -74,8 +107,17 @@ int main(int argc, char** argv)
   long half_num_data = numData / 2;
 
   // Warm-up! Insert half of input size
-  for(int i=0;i<half_num_data;++i) {
-    bt->btree_insert(keys[i], (char*) keys[i]);
+  if(fill_factor > 0) {
+    vector<pair<entry_key_t, char *> > sorted(half_num_data);
+    for(int i=0;i<half_num_data;++i)
+      sorted[i] = make_pair(keys[i], (char*) keys[i]);
+    sort(sorted.begin(), sorted.end());
+    bt->bulk_load(sorted.begin(), sorted.end(), fill_factor, n_threads);
+  }
+  else {
+    for(int i=0;i<half_num_data;++i) {
+      bt->btree_insert(keys[i], (char*) keys[i]);
+    }
   }
   cout << "Warm-up!" << endl;
 
@@ -97,9 +139,17 @@ int main(int argc, char** argv)
     int from = data_per_thread * tid;
     int to = (tid == n_threads - 1) ? half_num_data : from + data_per_thread;
 
-    auto f = async(launch::async, [&bt, &keys](int from, int to){
-      for(int i = from; i < to; ++i) 
-        bt->btree_search(keys[i]);
+    auto f = async(launch::async, [&bt, &keys, &batch](int from, int to){
+      if(batch > 0) {
+        char **values = new char *[batch];
+        for(int i = from; i < to; i += batch)
+          bt->multi_get(keys + i, min(batch, to - i), values);
+        delete[] values;
+      }
+      else {
+        for(int i = from; i < to; ++i) 
+          bt->btree_search(keys[i]);
+      }
       }, from, to);
     futures.push_back(move(f));
   }
@@ -121,9 +171,21 @@ int main(int argc, char** argv)
     int from = half_num_data + data_per_thread * tid;
     int to = (tid == n_threads - 1) ? numData : from + data_per_thread;
 
-    auto f = async(launch::async, [&bt, &keys](int from, int to){
-      for(int i = from; i < to; ++i)
-        bt->btree_insert(keys[i], (char*) keys[i]);
+    auto f = async(launch::async, [&bt, &keys, &put_batch](int from, int to){
+      if(put_batch > 0) {
+        char **values = new char *[put_batch];
+        for(int i = from; i < to; i += put_batch) {
+          int b = min(put_batch, to - i);
+          for(int j = 0; j < b; ++j)
+            values[j] = (char*) keys[i + j];
+          bt->multi_put(keys + i, values, b);
+        }
+        delete[] values;
+      }
+      else {
+        for(int i = from; i < to; ++i)
+          bt->btree_insert(keys[i], (char*) keys[i]);
+      }
       }, from, to);
     futures.push_back(move(f));
   }
@@ -134,6 +196,76 @@ int main(int argc, char** argv)
   clock_gettime(CLOCK_MONOTONIC,&end);
   elapsedTime = (end.tv_sec-start.tv_sec)*1000000000 + (end.tv_nsec-start.tv_nsec);
   cout<<"Concurrent inserting with " << n_threads << " threads (usec) : "<< (double)elapsedTime / (1000*numData) << endl; 
+
+  if(scan_len > 0) {
+    clear_cache();
+    futures.clear();
+
+    // Scan, as many scans as it takes to return about half_num_data values
+    long scans_per_thread = half_num_data / scan_len / n_threads;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+
+    for(int tid = 0; tid < n_threads; tid++) {
+      int from = data_per_thread * tid;
+      int to = from + scans_per_thread;
+
+      auto f = async(launch::async, [&bt, &keys, &scan_len](int from, int to){
+        unsigned long *buf = new unsigned long[scan_len];
+        for(int i = from; i < to; ++i)
+          bt->btree_search_range(keys[i], LONG_MAX, buf, scan_len);
+        delete[] buf;
+        }, from, to);
+      futures.push_back(move(f));
+    }
+    for(auto &&f : futures) 
+      if(f.valid())
+        f.get();
+
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    elapsedTime = (end.tv_sec-start.tv_sec)*1000000000 + (end.tv_nsec-start.tv_nsec);
+    cout<<"Concurrent scanning " << scan_len << " keys with " << n_threads << " threads (usec) : "<< (double)elapsedTime / (1000 * scans_per_thread * n_threads) << endl; 
+  }
+
+  if(del) {
+    clear_cache();
+    futures.clear();
+
+    // Delete the keys of the insert phase again. The leaves they empty are
+    // merged, so nodes have to come back from the epochs, and the keys of
+    // the warm-up have to survive the merges.
+    uint64_t freed = epoch_freed_bytes;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+
+    for(int tid = 0; tid < n_threads; tid++) {
+      int from = half_num_data + data_per_thread * tid;
+      int to = (tid == n_threads - 1) ? numData : from + data_per_thread;
+
+      auto f = async(launch::async, [&bt, &keys](int from, int to){
+        for(int i = from; i < to; ++i)
+          bt->btree_delete(keys[i]);
+        }, from, to);
+      futures.push_back(move(f));
+    }
+    for(auto &&f : futures) 
+      if(f.valid())
+        f.get();
+
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    elapsedTime = (end.tv_sec-start.tv_sec)*1000000000 + (end.tv_nsec-start.tv_nsec);
+    cout<<"Concurrent deleting with " << n_threads << " threads (usec) : "<< (double)elapsedTime / (1000*numData) << endl; 
+
+    epoch_reclaim_all();
+    cout<<"Retired bytes: " << epoch_retired_bytes << ", freed bytes: " << epoch_freed_bytes << endl;
+    long lost = 0;
+    for(int i = 0; i < half_num_data; ++i)
+      if(bt->btree_search(keys[i]) != (char*) keys[i])
+        ++lost;
+    if(epoch_freed_bytes == freed || lost) {
+      cout << "DELETE check failed: " << epoch_freed_bytes - freed << " bytes freed, "
+        << lost << " warm-up keys lost" << endl;
+      return 1;
+    }
+  }
 #else
   clock_gettime(CLOCK_MONOTONIC,&start);
 
@@ -187,6 +319,7 @@ int main(int argc, char** argv)
   clock_gettime(CLOCK_MONOTONIC,&end);
   elapsedTime = (end.tv_sec-start.tv_sec)*1000000000 + (end.tv_nsec-start.tv_nsec);
   cout<<"Concurrent inserting and searching with " << n_threads << " threads (usec) : "<< elapsedTime / 1000 << endl; 
+  cout<<"Retired bytes: " << epoch_retired_bytes << ", freed bytes: " << epoch_freed_bytes << endl;
 #endif
   //bt->printAll();
   delete bt;
@@ -18,18 +18,31 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <iterator>
+#include <string>
+#include <algorithm>
 #include <string.h>
 #include <cassert>
 #include <climits>
 #include <future>
 #include <mutex>
 #include <pthread.h>
+#include <immintrin.h>
+#include <new>
+#include <limits>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cpuid.h>
 #include "config.h"
 
 #define CPU_FREQ_MHZ (1566)
 #define DELAY_IN_NS (1000)
 #define CACHE_LINE_SIZE 64 
 #define QUERY_NUM 25
+#define POOL_SIZE (1UL << 30)
+#define POOL_MAGIC 0x324c4f5045524943UL // "CIREPOL2", tagged page offsets
 
 // Q: wth??
 #define IS_FORWARD(c) (c % 2 == 0)
@@ -64,120 +77,716 @@ using namespace std;
 
 inline void mfence()
 {
+#ifdef CRASH_SIM
+	crash_sim_fence();
+#endif
 	asm volatile("mfence":::"memory");
 }
 
+// Cache line write-back used by clflush(), picked once at startup from
+// CPUID. Legacy clflush is fenced on both sides; clflushopt and clwb are
+// weakly ordered and only need a single trailing sfence. PM_FLUSH=clflush,
+// clflushopt or clwb overrides the choice for benchmarking.
+enum flush_insn_t {FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB};
+
+static const char *flush_insn_name[] = {"clflush", "clflushopt", "clwb"};
+
+static flush_insn_t detect_flush_insn()
+{
+	unsigned int eax, ebx, ecx, edx;
+	bool supported[3] = {true, false, false};
+	if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+		supported[FLUSH_CLFLUSHOPT] = (ebx >> 23) & 1;
+		supported[FLUSH_CLWB] = (ebx >> 24) & 1;
+	}
+	flush_insn_t insn = supported[FLUSH_CLWB] ? FLUSH_CLWB :
+		(supported[FLUSH_CLFLUSHOPT] ? FLUSH_CLFLUSHOPT : FLUSH_CLFLUSH);
+	const char *env = getenv("PM_FLUSH");
+	if(env){
+		for(int i = 0; i < 3; ++i){
+			if(!strcmp(env, flush_insn_name[i])){
+				if(supported[i]) insn = (flush_insn_t)i;
+				else fprintf(stderr, "PM_FLUSH=%s is not supported by this CPU\n", env);
+			}
+		}
+	}
+	fprintf(stderr, "flush instruction: %s\n", flush_insn_name[insn]);
+	return insn;
+}
+
+flush_insn_t flush_insn = detect_flush_insn();
+
+inline void sfence()
+{
+#ifdef CRASH_SIM
+	crash_sim_fence();
+#endif
+	asm volatile("sfence":::"memory");
+}
+
+inline void flush_line(volatile char *ptr)
+{
+#ifdef CRASH_SIM
+	crash_sim_flush((char *)ptr);
+#endif
+	unsigned long etsc = read_tsc() + 
+		(unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
+	if(flush_insn == FLUSH_CLWB)
+		asm volatile("clwb %0" : "+m" (*(volatile char *)ptr));
+	else if(flush_insn == FLUSH_CLFLUSHOPT)
+		asm volatile("clflushopt %0" : "+m" (*(volatile char *)ptr));
+	else
+		asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
+	while (read_tsc() < etsc) cpu_pause();
+}
+
+inline void persist_fence()
+{
+	if(flush_insn == FLUSH_CLFLUSH)
+		mfence();
+	else
+		sfence();
+}
+
 inline void clflush(char *data, int len)
 {
 	volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-	mfence();
-	for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
-		unsigned long etsc = read_tsc() + 
-			(unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
-		asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
-		while (read_tsc() < etsc) cpu_pause();
-		//++clflush_cnt;
+	if(flush_insn == FLUSH_CLFLUSH)
+		mfence();
+	for(; ptr<data+len; ptr+=CACHE_LINE_SIZE)
+		flush_line(ptr);
+	persist_fence();
+}
+
+// Dirty cache lines of one node update, written back together with a
+// single fence. store() is called before writing to data: if that touches
+// a line not yet in the set, the lines collected so far are persisted
+// first, which keeps the line-by-line ordering a shift depends on.
+class flush_set {
+	private:
+		static const int max_lines = 8;
+		char *lines[max_lines];
+		int num_lines;
+
+		bool contains(char *line) {
+			for(int i = 0; i < num_lines; ++i)
+				if(lines[i] == line) return true;
+			return false;
+		}
+
+	public:
+		flush_set() : num_lines(0) {}
+
+		void add(char *data, int len) {
+			char *line = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
+			for(; line<data+len; line+=CACHE_LINE_SIZE){
+				if(contains(line)) continue;
+				if(num_lines == max_lines) persist();
+				lines[num_lines++] = line;
+			}
+		}
+
+		void store(char *data, int len) {
+			char *line = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
+			for(; line<data+len; line+=CACHE_LINE_SIZE){
+				if(!contains(line)){
+					persist();
+					break;
+				}
+			}
+			add(data, len);
+		}
+
+		void persist() {
+			if(num_lines == 0) return;
+			if(flush_insn == FLUSH_CLFLUSH)
+				mfence();
+			for(int i = 0; i < num_lines; ++i)
+				flush_line(lines[i]);
+			persist_fence();
+			num_lines = 0;
+		}
+};
+
+// Bounds of the mapped pool, nullptr while none is attached. A process
+// maps one pool at a time.
+char *pool_base = nullptr;
+char *pool_end = nullptr;
+
+// A page of the pool is stored as its distance from pool_base with the low
+// bit set, so a pool file can be mapped at a different address after a
+// restart. Pages in DRAM are 64-byte aligned and stored as they are, trees
+// outside the pool do not depend on it. Zero encodes nullptr.
+static inline uintptr_t pool_encode(void *p) {
+	uintptr_t v = (uintptr_t)p;
+	if(v >= (uintptr_t)pool_base && v < (uintptr_t)pool_end)
+		return (v - (uintptr_t)pool_base) | 1;
+	return v;
+}
+
+static inline void *pool_decode(uintptr_t v) {
+	return (v & 1) ? pool_base + (v & ~(uintptr_t)1) : (void *)v;
+}
+
+template <typename T>
+class pptr{
+	private:
+		uintptr_t off;
+
+	public:
+		pptr() : off(0) {}
+		pptr(T *p) { *this = p; }
+
+		pptr &operator=(T *p) {
+			off = pool_encode(p);
+			return *this;
+		}
+
+		T *get() const {
+			return (T *)pool_decode(off);
+		}
+
+		operator T *() const { return get(); }
+		T *operator->() const { return get(); }
+
+		template <typename U>
+			explicit operator U *() const { return (U *)get(); }
+};
+
+// Child pointers kept in internal node slots are pool-relative as well.
+// Leaf slots hold caller values, which are stored as given.
+static inline char *to_pool(char *p) {
+	return (char *)pool_encode(p);
+}
+
+static inline char *from_pool(char *off) {
+	return (char *)pool_decode((uintptr_t)off);
+}
+
+// Variable-length string key. The first 8 bytes are kept inline as a
+// big-endian integer, so most comparisons are a single integer compare and
+// the rest of the key is only read when two prefixes tie. A key of at most
+// 8 bytes lives entirely in the prefix. Keys are NUL-terminated and may not
+// start with 8 0xff bytes, which is the largest key.
+class string_key{
+	public:
+		uint64_t prefix;     // first 8 bytes, zero padded
+		const char *suffix;  // bytes after the prefix, nullptr if there are none
+
+		string_key() : prefix(0), suffix(nullptr) {}
+
+		// The key refers to s, the tree copies the suffix when it keeps the key
+		explicit string_key(const char *s) : prefix(0), suffix(nullptr) {
+			int i = 0;
+			for(; i < 8 && s[i]; ++i)
+				prefix |= (uint64_t)(unsigned char)s[i] << (56 - 8 * i);
+			if(i == 8 && s[8])
+				suffix = s + 8;
+		}
+
+		static int compare(const string_key &a, const string_key &b) {
+			if(a.prefix != b.prefix)
+				return a.prefix < b.prefix ? -1 : 1;
+			if(a.suffix == b.suffix)
+				return 0;
+			if(!a.suffix || !b.suffix)
+				return a.suffix ? 1 : -1;
+			return strcmp(a.suffix, b.suffix);
+		}
+
+		// Copy of the key with the suffix moved to memory of its own and
+		// flushed. The slot the copy is stored in owns it, a separator gets
+		// a copy of its own, see free_key.
+		string_key spill() const {
+			string_key k = *this;
+			if(suffix) {
+				size_t len = strlen(suffix) + 1;
+				char *copy = (char *)malloc(len);
+				memcpy(copy, suffix, len);
+				clflush(copy, len);
+				k.suffix = copy;
+			}
+			return k;
+		}
+
+		std::string str() const {
+			std::string s;
+			for(int i = 0; i < 8 && (char)(prefix >> (56 - 8 * i)); ++i)
+				s += (char)(prefix >> (56 - 8 * i));
+			if(suffix)
+				s += suffix;
+			return s;
+		}
+
+		bool operator==(const string_key &k) const { return compare(*this, k) == 0; }
+		bool operator!=(const string_key &k) const { return compare(*this, k) != 0; }
+		bool operator<(const string_key &k) const { return compare(*this, k) < 0; }
+		bool operator<=(const string_key &k) const { return compare(*this, k) <= 0; }
+		bool operator>(const string_key &k) const { return compare(*this, k) > 0; }
+		bool operator>=(const string_key &k) const { return compare(*this, k) >= 0; }
+};
+
+namespace std {
+	template <>
+	class numeric_limits<string_key> {
+		public:
+			static const bool is_specialized = true;
+			static string_key max() {
+				string_key k;
+				k.prefix = ~0UL;
+				return k;
+			}
+	};
+}
+
+// Key as the tree keeps it in a node
+template <typename K>
+static inline K spill_key(const K &key) { return key; }
+static inline string_key spill_key(const string_key &key) { return key.spill(); }
+
+// Release what spill_key allocated once the slot holding the key is gone
+template <typename K>
+static inline void free_key(const K &key) {}
+static inline void free_key(const string_key &key) { free((void *)key.suffix); }
+
+template <typename K>
+static inline void print_key(const K &key) { printf("%ld", (long)key); }
+static inline void print_key(const string_key &key) { printf("%s", key.str().c_str()); }
+
+// Separator pushed up by a leaf split: the shortest s with left < s <= right,
+// so the levels above string leaves hold short keys, mostly without a suffix.
+// It never shares the suffix of right, which goes away with the leaf slot.
+// An inner slot stays as wide as a leaf slot, so this saves comparisons,
+// not fanout.
+template <typename K>
+static inline K separator(const K &left, const K &right) { return right; }
+static inline string_key separator(const string_key &left, const string_key &right) {
+	if(!(left < right))
+		return right.spill();
+	string_key s;
+	uint64_t diff = left.prefix ^ right.prefix;
+	if(diff) {
+		int len = __builtin_clzll(diff) / 8 + 1;
+		s.prefix = (len == 8) ? right.prefix : right.prefix & ~(~0UL >> (8 * len));
+		return s;
 	}
-	mfence();
+	const char *l = left.suffix ? left.suffix : "";
+	size_t len = 0;
+	while(l[len] == right.suffix[len])
+		++len;
+	if(!right.suffix[len + 1])
+		return right.spill();
+	char *copy = (char *)malloc(len + 2);
+	memcpy(copy, right.suffix, len + 1);
+	copy[len + 1] = '\0';
+	clflush(copy, len + 2);
+	s.prefix = right.prefix;
+	s.suffix = copy;
+	return s;
 }
 
-class page;
+// Slot layout of a node: key and pointer interleaved in one array, or the
+// keys in one array and the pointers in a parallel one, so a search only
+// reads the cache lines holding keys.
+enum node_layout_t { NODE_AOS = 0, NODE_SOA = 1 };
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS> class page_t;
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS> class btree_iterator_t;
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS> class btree_reverse_iterator_t;
+
+// How a node is searched: slot-by-slot scan, binary search over the
+// logical (rotated) index of the circular array, or the vectorized
+// key comparison kernel.
+enum search_mode_t { LINEAR_SEARCH = 0, BINARY_SEARCH = 1, SIMD_SEARCH = 2 };
+
+// Where a full node splits: SPLIT_ADAPTIVE halves it unless APPEND_RUN or
+// so of its recent inserts landed among its last 1/APPEND_SPLIT keys,
+// SPLIT_EVEN always halves it and SPLIT_APPEND splits unevenly whenever the
+// overflowing key lands there. An uneven split keeps all but 1/APPEND_SPLIT
+// of the keys, so nodes behind an ascending key stream stay nearly full.
+enum split_policy_t { SPLIT_ADAPTIVE = 0, SPLIT_EVEN = 1, SPLIT_APPEND = 2 };
+
+#define APPEND_RUN 8
+#define APPEND_SPLIT 10
+
+class pool_header;
+
+// Levels a descent remembers for the splits and merges it causes, a taller
+// tree finds the parents of its upper levels from the root
+#define PATH_DEPTH 32
+
+// The tree is a template over the key type, an integer or string_key, the
+// value type, the number of slots per node and their layout. Leaf slots keep
+// values as char *, so a value has to be
+// a pointer or an integer of the same size. The cardinality is a power of
+// two, which turns the circular index arithmetic into masks with constant
+// operands.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout = NODE_AOS>
+class btree_t{
+	static_assert(Cardinality >= 8 && (Cardinality & (Cardinality - 1)) == 0,
+			"cardinality must be a power of two");
+	static_assert(Cardinality <= 65536, "slot indexes are 16 bits");
+	static_assert(std::is_integral<Key>::value || std::is_same<Key, string_key>::value,
+			"keys must be integers or string_key");
+	static_assert((std::is_pointer<Value>::value || std::is_integral<Value>::value) &&
+			sizeof(Value) == sizeof(char *), "values must fit in a slot pointer");
 
-class btree{
 	private:
+		typedef Key entry_key_t;
+		typedef page_t<Key, Value, Cardinality, Layout> page;
+		typedef btree_t<Key, Value, Cardinality, Layout> btree;
+		typedef btree_iterator_t<Key, Value, Cardinality, Layout> btree_iterator;
+		typedef btree_reverse_iterator_t<Key, Value, Cardinality, Layout> btree_reverse_iterator;
+		static const int cardinality = Cardinality;
+
 		int height;
-		char* root;
+		pptr<char> root;
+		search_mode_t search_mode;
+		split_policy_t split_policy;
+		bool use_finger;
+		pool_header *pool;  // the pages come from here, nullptr in DRAM
+
+		// Nodes a descent went through, by level, so a split or merge of the
+		// same operation finds the parent without descending again
+		struct path_t {
+			int top;  // level of the root the descent started at, -1 for none
+			page *node[PATH_DEPTH];
+			path_t() : top(-1) {}
+			void start(page *root) { top = root->hdr.level < PATH_DEPTH ? (int)root->hdr.level : -1; }
+			void visit(page *p) {
+				if((int)p->hdr.level <= top)
+					node[p->hdr.level] = p;
+			}
+			page *at(uint32_t level) { return (int)level <= top ? node[level] : nullptr; }
+		};
+
+		// Leaf a thread reached last in a tree and the separators that led
+		// to it, valid while the leaf keeps the version it had then
+		struct finger_t {
+			btree *tree;
+			page *leaf;
+			uint16_t version;
+			bool has_low, has_high;  // no separator bounds the first or last leaf
+			entry_key_t low, high;
+			path_t path;  // the descent that found the leaf
+			finger_t() : tree(nullptr) {}
+			bool holds(page *p) {
+				if(p == leaf)
+					return true;
+				for(int l = 0; l <= path.top; ++l)
+					if(path.node[l] == p)
+						return true;
+				return false;
+			}
+		};
+		static thread_local finger_t finger;
+
+		page *finger_leaf(entry_key_t);
 
 	public:
-		btree();
+		btree_t(search_mode_t mode = LINEAR_SEARCH, pool_header *pool = nullptr);
+		static btree *open(const char *path, size_t pool_size = POOL_SIZE);
+		static void close(btree *bt);
+		void set_search_mode(search_mode_t mode) { search_mode = mode; }
+		void set_split_policy(split_policy_t policy) { split_policy = policy; }
+		void set_finger(bool on) { use_finger = on; }
 		void setNewRoot(char *);
-		void btree_insert(entry_key_t, char*);
-		void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
+		void free_page(page *);
+		void btree_insert(entry_key_t, Value);
+		void multi_put(entry_key_t *, Value *, int);
+		void btree_insert_internal(char *, entry_key_t, char *, uint32_t, path_t * = nullptr);
+		template <typename It>
+			void bulk_load(It first, It last, double fill_factor = 1.0, int n_threads = 1);
+		static void bulk_link_level(std::vector<page *> &, int);
+		std::vector<page *> bulk_build_parents(std::vector<page *> &,
+				std::vector<entry_key_t> &, uint32_t, long, int);
 		void btree_delete(entry_key_t);
 		void btree_delete_internal
-			(entry_key_t, char *, uint32_t, entry_key_t *, bool *, page **, page**);
-		char *btree_search(entry_key_t);
-		void btree_search_range(entry_key_t, entry_key_t, unsigned long *); 
+			(entry_key_t, char *, uint32_t, entry_key_t *, bool *, page **, page**,
+			 path_t * = nullptr);
+		Value btree_search(entry_key_t);
+		void multi_get(entry_key_t *, int, Value *);
+		int btree_search_range(entry_key_t, entry_key_t, unsigned long *, int); 
+		int btree_search_range_reverse(entry_key_t, entry_key_t, unsigned long *, int); 
 		void printAll();
 
-		friend class page;
+		template <typename, typename, int, node_layout_t> friend class page_t;
+		template <typename, typename, int, node_layout_t> friend class btree_iterator_t;
+		template <typename, typename, int, node_layout_t> friend class btree_reverse_iterator_t;
 };
 
-class entry{ 
+// First block of a pool file: allocator metadata and the btree itself,
+// which reaches every page through pool-relative pointers.
+class pool_header{
+	public:
+		uint64_t magic;
+		uint64_t size;       // bytes in the pool file
+		uint64_t next;       // first never allocated byte
+		uint64_t free_list;  // offset of the first freed page, chained
+		uint64_t node_size;  // bytes per page, a pool is only reopened with the same
+		uint64_t node_layout;  // and the same node_layout_t
+		alignas(CACHE_LINE_SIZE) char tree[CACHE_LINE_SIZE];  // the btree_t object
+
+		// A page of node_size bytes, the only size the free list holds
+		void *alloc(size_t bytes) {
+			if(bytes != node_size)
+				throw std::bad_alloc();
+			char *base = (char *)this;
+			char *ret;
+			if(free_list) {
+				ret = base + free_list;
+				free_list = *(uint64_t *)ret;
+				clflush((char *)&free_list, sizeof(uint64_t));
+				return ret;
+			}
+			bytes = (bytes + CACHE_LINE_SIZE - 1) & ~(uint64_t)(CACHE_LINE_SIZE - 1);
+			if(next + bytes > size)
+				throw std::bad_alloc();
+			ret = base + next;
+			next += bytes;
+			clflush((char *)&next, sizeof(uint64_t));
+			return ret;
+		}
+
+		void free(void *p) {
+			*(uint64_t *)p = free_list;
+			clflush((char *)p, sizeof(uint64_t));
+			free_list = (char *)p - (char *)this;
+			clflush((char *)&free_list, sizeof(uint64_t));
+		}
+};
+
+const uint64_t pool_data_start = 4096;
+
+static bool pool_zero(const char *p, size_t len) {
+	for(size_t i = 0; i < len; ++i)
+		if(p[i])
+			return false;
+	return true;
+}
+
+template <typename Key>
+class entry_t{ 
 	private:
-		entry_key_t key; // 8 bytes
+		Key key; // 8 bytes
 		char* ptr; // 8 bytes
 	public :
-		entry(){
-			key = LONG_MAX;
+		entry_t(){
+			key = std::numeric_limits<Key>::max();
 			ptr = nullptr;
 		}
 
-		friend class page;
-		friend class btree;
+		template <typename, typename, int, node_layout_t> friend class page_t;
+		template <typename, typename, int, node_layout_t> friend class btree_t;
 };
 
-const int cardinality = record_size;
+// Slot i of a node whose keys and pointers live in separate arrays
+template <typename Key>
+class slot_ref_t{
+	public:
+		Key &key;
+		char *&ptr;
+
+		slot_ref_t(Key &k, char *&p) : key(k), ptr(p) {}
+		slot_ref_t &operator=(const slot_ref_t &s) {
+			key = s.key;
+			ptr = s.ptr;
+			return *this;
+		}
+};
+
+// Does a field of len bytes at addr start a cache line, or run into the
+// next one? Shifts write back a line once they reach it.
+static inline bool opens_line(void *addr, int len) {
+	int remainder = (uint64_t)addr & (CACHE_LINE_SIZE - 1);
+	return (remainder == 0) ||
+		((((int)(remainder + len) / CACHE_LINE_SIZE) == 1) &&
+		 ((remainder + len) & (CACHE_LINE_SIZE - 1)) != 0);
+}
 
-class header{
+// The slots of a node. records[i] gives slot i with .key and .ptr in either
+// layout; the rest names the cache lines slot i lives in.
+template <typename Key, int Cardinality, node_layout_t Layout>
+class records_t;
+
+template <typename Key, int Cardinality>
+class records_t<Key, Cardinality, NODE_AOS>{
 	private:
+		typedef entry_t<Key> entry;
+		entry e[Cardinality];
 
-		entry* records;              // 8B
+	public:
+		typedef entry &reference;
+		static const int per_line = CACHE_LINE_SIZE / sizeof(entry);
+
+		inline reference operator[](int i) { return e[i]; }
+		// contiguous slots from i, in the form the search kernels take
+		inline entry *run(int i) { return &e[i]; }
+
+		inline void add(flush_set &fs, int i) { fs.add((char *)&e[i], sizeof(entry)); }
+		inline void store(flush_set &fs, int i) { fs.store((char *)&e[i], sizeof(entry)); }
+		inline void flush(int i, int n) { clflush((char *)&e[i], n * sizeof(entry)); }
+		inline void prefetch(int i) { __builtin_prefetch(&e[i]); }
+		inline void prefetch_slot(int i) { __builtin_prefetch(&e[i]); }
+
+		inline void flush_if_opens_line(int i) {
+			if(opens_line(&e[i], sizeof(entry)))
+				clflush((char *)&e[i], CACHE_LINE_SIZE);
+		}
+
+		// write back slot i unless it shares the lines written back last
+		inline void write_back(int i, char **last) {
+			char *line = (char *)((unsigned long)&e[i] & ~(CACHE_LINE_SIZE - 1));
+			if(line != last[0])
+				::flush_line(line);
+			last[0] = line;
+		}
+};
+
+template <typename Key, int Cardinality>
+class records_t<Key, Cardinality, NODE_SOA>{
+	private:
+		Key keys[Cardinality];
+		alignas(CACHE_LINE_SIZE) char *ptrs[Cardinality];
+
+	public:
+		typedef slot_ref_t<Key> reference;
+		static const int per_line = CACHE_LINE_SIZE / sizeof(Key);
+
+		records_t() {
+			for(int i = 0; i < Cardinality; ++i) {
+				keys[i] = std::numeric_limits<Key>::max();
+				ptrs[i] = nullptr;
+			}
+		}
+
+		inline reference operator[](int i) { return reference(keys[i], ptrs[i]); }
+		inline Key *run(int i) { return &keys[i]; }
+
+		inline void add(flush_set &fs, int i) {
+			fs.add((char *)&keys[i], sizeof(Key));
+			fs.add((char *)&ptrs[i], sizeof(char *));
+		}
+		inline void store(flush_set &fs, int i) {
+			fs.store((char *)&keys[i], sizeof(Key));
+			fs.store((char *)&ptrs[i], sizeof(char *));
+		}
+		inline void flush(int i, int n) {
+			clflush((char *)&keys[i], n * sizeof(Key));
+			clflush((char *)&ptrs[i], n * sizeof(char *));
+		}
+		// a search reads the keys, the pointer of the slot found comes last
+		inline void prefetch(int i) { __builtin_prefetch(&keys[i]); }
+		inline void prefetch_slot(int i) {
+			__builtin_prefetch(&keys[i]);
+			__builtin_prefetch(&ptrs[i]);
+		}
+
+		inline void flush_if_opens_line(int i) {
+			if(opens_line(&keys[i], sizeof(Key)))
+				clflush((char *)&keys[i], CACHE_LINE_SIZE);
+			if(opens_line(&ptrs[i], sizeof(char *)))
+				clflush((char *)&ptrs[i], CACHE_LINE_SIZE);
+		}
+
+		inline void write_back(int i, char **last) {
+			char *line = (char *)((unsigned long)&keys[i] & ~(CACHE_LINE_SIZE - 1));
+			if(line != last[0])
+				::flush_line(line);
+			last[0] = line;
+			line = (char *)((unsigned long)&ptrs[i] & ~(CACHE_LINE_SIZE - 1));
+			if(line != last[1])
+				::flush_line(line);
+			last[1] = line;
+		}
+};
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class header_t{
+	private:
+		typedef page_t<Key, Value, Cardinality, Layout> page;
+
+		pptr<page> leftmost_ptr;          // 8B
+		pptr<page> right_sibling_ptr;     // 8B
 		uint16_t first_index;         // 2B
 		uint16_t num_valid_key;       // 2B
-		page* leftmost_ptr;          // 8B
-		page* right_sibling_ptr;     // 8B
 		uint16_t level;               // 2B
 		uint16_t is_deleted;          // 2B
+		uint16_t appends;             // 2B, +1 per append, halved by other inserts
+		uint16_t version;             // 2B, +1 whenever the key range of the node changes
+		char dummy[36];               // 36B, pad the header to one cache line
 
-
-
-		friend class page;
-		friend class btree;
+		template <typename, typename, int, node_layout_t> friend class page_t;
+		template <typename, typename, int, node_layout_t> friend class btree_t;
+		template <typename, typename, int, node_layout_t> friend class btree_iterator_t;
+		template <typename, typename, int, node_layout_t> friend class btree_reverse_iterator_t;
 
 	public:
-		header() {
-			records = new entry[cardinality];
+		header_t() {
 			first_index = 0;
 			num_valid_key = 0;
 			leftmost_ptr = nullptr;  
 
 			right_sibling_ptr = nullptr;
 			is_deleted = false;
-
+			appends = 0;
+			version = 0;
 		}
 
-		~header() {
-			delete[] records;
+		~header_t() {
 		}
 };
 
+// Key comparison kernel used by SIMD_SEARCH, picked once at startup.
+enum simd_level_t { SIMD_SCALAR = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
 
+static simd_level_t detect_simd_level() {
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if(__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	return SIMD_SCALAR;
+}
 
+simd_level_t simd_level = detect_simd_level();
 
-const int count_in_line = CACHE_LINE_SIZE / sizeof(entry);
-
-class page{
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class page_t{
 	private:
-		header hdr;  // header in persistent memory
+		typedef Key entry_key_t;
+		typedef entry_t<Key> entry;
+		typedef header_t<Key, Value, Cardinality, Layout> header;
+		typedef page_t<Key, Value, Cardinality, Layout> page;
+		typedef btree_t<Key, Value, Cardinality, Layout> btree;
+		typedef typename btree::path_t path_t;
+		typedef typename records_t<Key, Cardinality, Layout>::reference slot;
+		static const int cardinality = Cardinality;
+
+		header hdr;  // header in persistent memory, 64 bytes
+		records_t<Key, Cardinality, Layout> records; // slots in persistent memory, 16 bytes * n
+
+		static_assert(sizeof(header) == CACHE_LINE_SIZE, "header must fit in one cache line");
 
 	public:
-		friend class btree;
+		template <typename, typename, int, node_layout_t> friend class btree_t;
+		template <typename, typename, int, node_layout_t> friend class btree_iterator_t;
+		template <typename, typename, int, node_layout_t> friend class btree_reverse_iterator_t;
 
-		page(uint32_t level = 0) {
+		page_t(uint32_t level = 0) {
 			hdr.level = level;
-			hdr.records[0].ptr = nullptr;
+			records[0].ptr = nullptr;
 		}
 
 		// this is called when tree grows
 		// TODO: change this construction
-		page(page* left, entry_key_t key, page* right, uint32_t level = 0) {
+		page_t(page* left, entry_key_t key, page* right, uint32_t level = 0) {
 			hdr.leftmost_ptr = left;  
 			// TODO: add right to sibling?
 			hdr.level = level;
-			hdr.records[0].key = key;
-			hdr.records[0].ptr = (char*) right;
-			hdr.records[1].ptr = nullptr;
+			records[0].key = key;
+			records[0].ptr = to_pool((char*) right);
+			records[1].ptr = nullptr;
 
 			hdr.first_index = 0;
 			hdr.num_valid_key = 1;
@@ -185,12 +794,37 @@ class page{
 			clflush((char*)this, sizeof(page));
 		}
 
-		void *operator new(size_t size) {
+		// A page comes from the pool of the tree it is part of, if it has one,
+		// and goes back through btree::free_page
+		void *operator new(size_t size, btree *bt) {
+			if(bt->pool)
+				return bt->pool->alloc(size);
 			void *ret;
+#ifdef CRASH_SIM
+			ret = crash_sim_alloc(size);
+#else
 			posix_memalign(&ret,64,size);
+#endif
 			return ret;
 		}
 
+		void operator delete(void *p, btree *bt) {
+			if(bt->pool)
+				bt->pool->free(p);
+			else
+#ifdef CRASH_SIM
+				crash_sim_free(p);
+#else
+				free(p);
+#endif
+		}
+
+		// Flush a node built in place by bulk_load, whose entries do not wrap
+		void flush_node() {
+			clflush((char *)&hdr, sizeof(header));
+			records.flush(hdr.first_index, hdr.num_valid_key);
+		}
+
 		inline int count() {
 			// TODO: ensure the num_valid_key's automic
 			return hdr.num_valid_key;
@@ -208,6 +842,12 @@ class page{
 		}
 
 
+		// True if a key reaching the left sibling has moved here. The slots
+		// of an empty node hold keys freed before, it takes none.
+		inline bool takes(entry_key_t key) {
+			return count() > 0 && !(key < records[hdr.first_index].key);
+		}
+
 		bool remove_key(entry_key_t key) {
 			int last_index = get_last_idx();
 
@@ -215,63 +855,54 @@ class page{
 			bool shift = false;
 			bool is_left = false;
 			int i;
+			entry_key_t removed = entry_key_t();
+
+			// the slots of an empty node hold keys freed before
+			if(hdr.num_valid_key == 0)
+				return false;
 
 			register int m = (hdr.first_index+(int)ceil(hdr.num_valid_key>>1)) & (cardinality - 1);
 			
-			if (key < hdr.records[m].key){ // deletion in left part
+			if (key < records[m].key){ // deletion in left part
 				for(i = (hdr.num_valid_key >> 1) - 1; i>=0; --i) {
 					uint32_t idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
 					// TODO: something wrong about leftmost_ptr
-					if(!shift && hdr.records[idx].key == key) {
+					if(!shift && records[idx].key == key) {
 						// the key in the first_position is going to be removed.
-						hdr.records[idx].ptr = (idx == hdr.first_index ) ? 
-							(char *)hdr.leftmost_ptr : hdr.records[(idx-1) & (cardinality - 1)].ptr;
+						removed = records[idx].key;
+						records[idx].ptr = (idx == hdr.first_index ) ? 
+							to_pool((char *)hdr.leftmost_ptr) : records[(idx-1) & (cardinality - 1)].ptr;
 						shift = true;
 						is_left = true;
 					}
 
 					if(shift) {
 						int prev_idx = get_index(idx-1);
-						hdr.records[idx].key = (idx==hdr.first_index) ? hdr.records[idx].key : hdr.records[prev_idx].key;
-						hdr.records[idx].ptr = (idx==hdr.first_index)? nullptr : hdr.records[prev_idx].ptr;
+						records[idx].key = (idx==hdr.first_index) ? records[idx].key : records[prev_idx].key;
+						records[idx].ptr = (idx==hdr.first_index)? nullptr : records[prev_idx].ptr;
 
 						// flush
-						uint64_t records_ptr = (uint64_t)(&hdr.records[idx]);
-						int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-						//Q: how??
-						bool do_flush = (remainder == 0) || 
-							((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) && 
-							 ((remainder + sizeof(entry)) & (CACHE_LINE_SIZE - 1)) != 0);
-						if(do_flush) {
-							clflush((char *)records_ptr, CACHE_LINE_SIZE);
-						}
+						records.flush_if_opens_line(idx);
 					}
 				}
 			}else{ // del in right part
 				for(i = (hdr.num_valid_key) >> 1; i < hdr.num_valid_key; ++i) {
 					uint32_t idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-					if(!shift && hdr.records[idx].key == key) {
+					if(!shift && records[idx].key == key) {
 						// the key in the first_position is going to be removed.
-						hdr.records[idx].ptr = (idx == hdr.first_index ) ? 
-							(char *)hdr.leftmost_ptr : hdr.records[(idx-1) & (cardinality - 1)].ptr; 
+						removed = records[idx].key;
+						records[idx].ptr = (idx == hdr.first_index ) ? 
+							to_pool((char *)hdr.leftmost_ptr) : records[(idx-1) & (cardinality - 1)].ptr; 
 						shift = true;
 					}
 
 					if(shift) {
 						int next_idx = get_index(idx + 1);
-						hdr.records[idx].key = (idx==last_index)? hdr.records[idx].key : hdr.records[next_idx].key;
-						hdr.records[idx].ptr = (idx==last_index)? nullptr : hdr.records[next_idx].ptr;
+						records[idx].key = (idx==last_index)? records[idx].key : records[next_idx].key;
+						records[idx].ptr = (idx==last_index)? nullptr : records[next_idx].ptr;
 
 						// flush
-						uint64_t records_ptr = (uint64_t)(&hdr.records[idx]);
-						int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-						//Q: how??
-						bool do_flush = (remainder == 0) || 
-							((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) && 
-							 ((remainder + sizeof(entry)) & (CACHE_LINE_SIZE - 1)) != 0);
-						if(do_flush) {
-							clflush((char *)records_ptr, CACHE_LINE_SIZE);
-						}
+						records.flush_if_opens_line(idx);
 					}
 				}
 			}
@@ -282,11 +913,15 @@ class page{
 					hdr.first_index = (hdr.first_index + 1) & (cardinality - 1);
 					clflush((char *)&(hdr.first_index), sizeof(uint32_t));
 				} 
+				// a separator that goes away is freed by the merge dropping it
+				if(hdr.leftmost_ptr == nullptr)
+					free_key(removed);
 			}
 			return shift;
 		}
 
-		bool remove(btree* bt, entry_key_t key, bool only_rebalance = false, bool with_lock = true) {
+		bool remove(btree* bt, entry_key_t key, bool only_rebalance = false, bool with_lock = true,
+				path_t *path = nullptr) {
 			if(!only_rebalance) {
 				register int num_entries_before = count();
 
@@ -295,7 +930,7 @@ class page{
 					if(hdr.level > 0) {
 						if(num_entries_before == 1 && !hdr.right_sibling_ptr) {
 							// bt->root = (char *)hdr.leftmost_ptr;
-							bt->root = hdr.records[hdr.first_index].ptr;
+							bt->root = from_pool(records[hdr.first_index].ptr);
 							clflush((char *)&(bt->root), sizeof(char *));
 
 							hdr.is_deleted = 1;
@@ -323,20 +958,22 @@ class page{
 			} 
 
 			//Remove a key from the parent node
-			entry_key_t deleted_key_from_parent = 0;
+			entry_key_t deleted_key_from_parent = entry_key_t();
 			bool is_leftmost_node = false;
 			page *left_sibling = nullptr;
 			page* left_left_sibling = nullptr;
 			// return true;
 			bt->btree_delete_internal(key, (char *)this, hdr.level + 1,
-					&deleted_key_from_parent, &is_leftmost_node, &left_sibling, &left_left_sibling);
+					&deleted_key_from_parent, &is_leftmost_node, &left_sibling, &left_left_sibling, path);
 			// return true;
 			if(is_leftmost_node) {
 				// Q: get it! The key from parent node is setted by the first KV of the right sibling node.
 				// need to delete key from parent node to and merge
 				// return true;
-				hdr.right_sibling_ptr->remove(bt, hdr.right_sibling_ptr->hdr.records[hdr.right_sibling_ptr->hdr.first_index].key, true,
-						with_lock);
+				// an empty sibling has no key to look its parent up with
+				if(hdr.right_sibling_ptr && hdr.right_sibling_ptr->count() > 0)
+					hdr.right_sibling_ptr->remove(bt, hdr.right_sibling_ptr->records[hdr.right_sibling_ptr->hdr.first_index].key, true,
+							with_lock, path);
 				return true;
 			}
 			
@@ -360,18 +997,18 @@ class page{
 						for(int i=left_num_entries - 1; i>=m; --i){
 							int insert_idx = get_index(left_sibling->hdr.first_index + i);
 							insert_key
-								(left_sibling->hdr.records[insert_idx].key, left_sibling->hdr.records[insert_idx].ptr, &num_entries); 
+								(left_sibling->records[insert_idx].key, left_sibling->records[insert_idx].ptr, &num_entries); 
 
 						} 
 						// set the key in last index, but not set the KV to nullptr
 						int mid_idx = get_index(left_sibling->hdr.first_index + m);
-						left_sibling->hdr.records[mid_idx].ptr = nullptr;
-						clflush((char *)&(left_sibling->hdr.records[mid_idx].ptr), sizeof(char *));
+						left_sibling->records[mid_idx].ptr = nullptr;
+						clflush((char *)&(left_sibling->records[mid_idx].ptr), sizeof(char *));
 
 						left_sibling->hdr.num_valid_key -= (left_num_entries - m);
 						clflush((char *)&(left_sibling->hdr.num_valid_key), sizeof(uint32_t));
 
-						parent_key = hdr.records[hdr.first_index].key; 
+						parent_key = records[hdr.first_index].key; 
 					}
 					else{ // redistribution between internal node
 						insert_key(deleted_key_from_parent, (char*)hdr.leftmost_ptr,
@@ -380,16 +1017,16 @@ class page{
 						for(int i=left_num_entries - 1; i>m; --i){
 							int insert_idx = get_index(left_sibling->hdr.first_index + i);
 							insert_key
-								(left_sibling->hdr.records[insert_idx].key, left_sibling->hdr.records[insert_idx].ptr, &num_entries); 
+								(left_sibling->records[insert_idx].key, left_sibling->records[insert_idx].ptr, &num_entries); 
 						}
 						int mid_idx = get_index(left_sibling->hdr.first_index + m);
-						parent_key = left_sibling->hdr.records[mid_idx].key; 
+						parent_key = left_sibling->records[mid_idx].key; 
 						// change the leftmost_ptr here
-						hdr.leftmost_ptr = (page*)left_sibling->hdr.records[mid_idx].ptr; 
+						hdr.leftmost_ptr = (page*)left_sibling->records[mid_idx].ptr; 
 						clflush((char *)&(hdr.leftmost_ptr), sizeof(page *));
 
-						left_sibling->hdr.records[mid_idx].ptr = nullptr;
-						clflush((char *)&(left_sibling->hdr.records[mid_idx].ptr), sizeof(char *));
+						left_sibling->records[mid_idx].ptr = nullptr;
+						clflush((char *)&(left_sibling->records[mid_idx].ptr), sizeof(char *));
 
 
 						left_sibling->hdr.num_valid_key -= (left_num_entries - m - 1);  // careful!
@@ -397,7 +1034,7 @@ class page{
 					}
 
 					if(left_sibling == ((page *)bt->root)) {
-						page* new_root = new page(left_sibling, parent_key, this, hdr.level + 1);
+						page* new_root = new (bt) page(left_sibling, parent_key, this, hdr.level + 1);
 						bt->setNewRoot((char *)new_root);
 					}
 					else {
@@ -413,15 +1050,17 @@ class page{
 				// return true;
 				left_sibling->hdr.is_deleted = 1;
 				clflush((char *)&(left_sibling->hdr.is_deleted), sizeof(uint16_t));
+				++hdr.version;
 				if(left_sibling->hdr.leftmost_ptr)
 					insert_key(deleted_key_from_parent, 
-							(char *)hdr.leftmost_ptr, &left_num_entries);
-				
+							to_pool((char *)hdr.leftmost_ptr), &left_num_entries);
+				else
+					free_key(deleted_key_from_parent);
 
 
 				for(int i = 0; i < left_sibling->hdr.num_valid_key; ++i) {
 					int idx = (left_sibling->hdr.first_index + i) & (cardinality - 1); 
-					insert_key(left_sibling->hdr.records[idx].key, left_sibling->hdr.records[idx].ptr, &num_entries);
+					insert_key(left_sibling->records[idx].key, left_sibling->records[idx].ptr, &num_entries);
 				}
 
 				
@@ -430,7 +1069,7 @@ class page{
 					clflush((char *)&(left_left_sibling->hdr.right_sibling_ptr), sizeof(page *));	
 				}
 				
-				delete left_sibling;
+				bt->free_page(left_sibling);
 				
 			}else{
 
@@ -447,167 +1086,118 @@ class page{
 
 				// TODO: Flush, Optimization, 
 				bool is_left = false;
+				flush_set fs;
 				if(*num_entries == 0) {  // this page is empty
-					entry* new_entry = (entry*) &hdr.records[0];
-					entry* array_end = (entry*) &hdr.records[1];
-					new_entry->key = (entry_key_t) key;
-					new_entry->ptr = (char*) ptr;
+					records[0].key = (entry_key_t) key;
+					records[0].ptr = (char*) ptr;
 
-					array_end->ptr = (char*)nullptr;
+					records[1].ptr = (char*)nullptr;
 					hdr.first_index = 0;
 
 					if(flush) { // FIXME -- wangc@2020.03.08
-						clflush((char*) this, CACHE_LINE_SIZE);
+						fs.add((char*) &hdr, sizeof(header));
+						records.add(fs, 0);
 					}
 				}
 				else {
 					// TODO: wired here. Have to know the usage of these code.
 					int i = *num_entries - 1, inserted = 0;
 
-					if (hdr.leftmost_ptr != nullptr){
-						for (i = *num_entries-1; i>=hdr.first_index; i--){
-							if (key < hdr.records[i].key){
-								hdr.records[i+1].ptr = hdr.records[i].ptr;
-								hdr.records[i+1].key = hdr.records[i].key;
-								if(flush) {
-									uint64_t records_ptr = (uint64_t)(&hdr.records[i+1]);
-
-									int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-									bool do_flush = (remainder == 0) || 
-										((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
-										 && ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
-									if(do_flush) {
-										clflush((char*)(&records_ptr),CACHE_LINE_SIZE);
-									}
-								}
-							}else{
-								hdr.records[i+1].ptr = hdr.records[i].ptr;
-								hdr.records[i+1].key = key;
-								hdr.records[i+1].ptr = ptr;
+					// circle tree insertion, used by leaf and internal nodes alike.
+					// Pairs (key, ptr) are shifted as a whole, so the child on the
+					// right of every separator and the leftmost_ptr are preserved.
+
+					// shift the left part
+					// FIXME, do not use division like "*num_entries / 2". It is slow. Replace with bit shift. -- wangc@2020.03.08
+					if (key < records[(hdr.first_index + (*num_entries >> 1)) & (cardinality - 1)].key){
+						// insert in the left part
+						// copy the leftmost_ptr first.
+						// FIXME, avoid 0.5 in code. Use integers. -- wangc@2020.03.08
+						for(i = 0; i<(*num_entries >> 1); i++){
+							int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
+							if (key > records[idx].key){
+								int insert_idx = (idx - 1) & (cardinality - 1);
 								if(flush)
-									clflush((char*)&hdr.records[i+1],sizeof(entry));
-								inserted = 1;
+									records.store(fs, insert_idx);
+								records[insert_idx].ptr = records[idx].ptr;
+								records[insert_idx].key = records[idx].key;
+							} else {
 								break;
 							}
-						}
-						if(inserted==0){
-							hdr.records[0].ptr =(char*) hdr.leftmost_ptr;
-							hdr.records[0].key = key;
-							hdr.records[0].ptr = ptr;
-							if(flush)
-								clflush((char*) &hdr.records[0], sizeof(entry)); 
-							hdr.first_index = 0;
-						}
-					}else{
-						// circle tree insertion
-
-						// shift the left part
-						// FIXME, do not use division like "*num_entries / 2". It is slow. Replace with bit shift. -- wangc@2020.03.08
-						if (key < hdr.records[(hdr.first_index + (*num_entries >> 1)) & (cardinality - 1)].key){
-							// insert in the left part
-							// copy the leftmost_ptr first.
-							// FIXME, avoid 0.5 in code. Use integers. -- wangc@2020.03.08
-							for(i = 0; i<(*num_entries >> 1); i++){
-								int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-								if (key > hdr.records[idx].key){
-									int insert_idx = (idx - 1) & (cardinality - 1);
-									hdr.records[insert_idx].ptr = hdr.records[idx].ptr;
-									hdr.records[insert_idx].key = hdr.records[idx].key;
-									// flush the cacheline if A[idx] is at the start of a cache line;
-									if(flush) {
-										uint64_t records_ptr = (uint64_t)(&hdr.records[idx]);
-
-										int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-										bool do_flush = (remainder == 0) || 
-											((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
-											 && ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
-										if(do_flush) {
-											clflush((char*)(&hdr.records[insert_idx]),CACHE_LINE_SIZE);
-										}
-									}
-								} else {
-									break;
-								}
-							}// end for
-							// insert the key and ptr to new position
-							int insert_idx = (hdr.first_index + i - 1) & (cardinality - 1);
-							hdr.records[insert_idx].key = key;
-							hdr.records[insert_idx].ptr = ptr;
-							if(flush)
-								clflush((char*)&hdr.records[insert_idx], sizeof(entry));
-							is_left = true;
-							inserted = 1;
-							// TODO: update b_node, flush b_node;
-						}else{  // shift the right part
-							// copy the rightmost ptr firstly.
-
-							for(i = *num_entries - 1; i>=(*num_entries >> 1); i--){
-								int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
-								if (key < hdr.records[idx].key){
-									int insert_idx = (idx + 1) & (cardinality - 1);
-									hdr.records[insert_idx].ptr = hdr.records[idx].ptr;
-									hdr.records[insert_idx].key = hdr.records[idx].key;
-									// flush the cacheline if A[idx] is at the start of a cache line;
-									if(flush) {
-										uint64_t records_ptr = (uint64_t)(&hdr.records[insert_idx]);
-
-										int remainder = records_ptr & (CACHE_LINE_SIZE - 1);
-										bool do_flush = (remainder == 0) || 
-											((((int)(remainder + sizeof(entry)) / CACHE_LINE_SIZE) == 1) 
-											 && ((remainder+sizeof(entry))&(CACHE_LINE_SIZE - 1))!=0);
-										if(do_flush) {
-											clflush((char*)(&hdr.records[insert_idx]),CACHE_LINE_SIZE);
-
-										}
-									}
-								}else{
-									break;
-								}
-							}// end for
-							// insert the key and ptr to new position
-							int insert_idx = (hdr.first_index + i + 1) & (cardinality - 1);
-							hdr.records[insert_idx].key = key;
-							hdr.records[insert_idx].ptr = ptr;
-							inserted = 1;
-							if(flush)
-								clflush((char*)&hdr.records[insert_idx],sizeof(entry));
-							// TODO: update b_node, flush b_node;
-						}
-						if(inserted==0){
-							hdr.records[0].ptr =(char*) hdr.leftmost_ptr;
-							hdr.records[0].key = key;
-							hdr.records[0].ptr = ptr;
-							if(flush)
-								clflush((char*) &hdr.records[0], sizeof(entry)); 
-							hdr.first_index = 0;
-						}
+						}// end for
+						// insert the key and ptr to new position
+						int insert_idx = (hdr.first_index + i - 1) & (cardinality - 1);
+						if(flush)
+							records.store(fs, insert_idx);
+						records[insert_idx].key = key;
+						records[insert_idx].ptr = ptr;
+						is_left = true;
+						inserted = 1;
+						// TODO: update b_node, flush b_node;
+					}else{  // shift the right part
+						// copy the rightmost ptr firstly.
+
+						for(i = *num_entries - 1; i>=(*num_entries >> 1); i--){
+							int idx = (hdr.first_index + i) & (cardinality - 1);  // index = (nh.b + i) % N
+							if (key < records[idx].key){
+								int insert_idx = (idx + 1) & (cardinality - 1);
+								if(flush)
+									records.store(fs, insert_idx);
+								records[insert_idx].ptr = records[idx].ptr;
+								records[insert_idx].key = records[idx].key;
+							}else{
+								break;
+							}
+						}// end for
+						// insert the key and ptr to new position
+						int insert_idx = (hdr.first_index + i + 1) & (cardinality - 1);
+						if(flush)
+							records.store(fs, insert_idx);
+						records[insert_idx].key = key;
+						records[insert_idx].ptr = ptr;
+						inserted = 1;
+						// TODO: update b_node, flush b_node;
+					}
+					if(inserted==0){
+						records[0].ptr =(char*) hdr.leftmost_ptr;
+						if(flush)
+							records.store(fs, 0);
+						records[0].key = key;
+						records[0].ptr = ptr;
+						hdr.first_index = 0;
 					}
 				}
 
+				// the header is published only after the entries it covers
+				if(flush)
+					fs.store((char *)&hdr, sizeof(header));
 				++(*num_entries);
 				// important   TODO: colision here?
 				++hdr.num_valid_key;
-				if (is_left){
+				if (is_left)
 					hdr.first_index = (hdr.first_index - 1) & (cardinality - 1);
-					clflush((char *)&(hdr.first_index), sizeof(uint16_t));
-				} 
-				// FIXME, you need to flush first_index. -- wangc@2020.03.08
+				if(flush)
+					fs.persist();
 			}
 
 		// Insert a new key - FAST and FAIR
 		page *store
 			(btree* bt, char* left, entry_key_t key, char* right,
-			 bool flush, page *invalid_sibling = nullptr) {
+			 bool flush, page *invalid_sibling = nullptr, path_t *path = nullptr) {
 				// If this node has a sibling node,
 				if(hdr.right_sibling_ptr && (hdr.right_sibling_ptr != invalid_sibling)) {
 					// Compare this key with the first key of the sibling
-					if(key > hdr.right_sibling_ptr->hdr.records[hdr.right_sibling_ptr->hdr.first_index].key) {
+					if(hdr.right_sibling_ptr->takes(key)) {
 						return hdr.right_sibling_ptr->store(bt, nullptr, key, right, 
-								true, invalid_sibling);
+								true, invalid_sibling, path);
 					}
 				}
 
 				register int num_entries = hdr.num_valid_key;
+				bool append = count_append(key);
+				// the leaf slot keeps a copy of the key, a separator is the parent's
+				if(hdr.leftmost_ptr == nullptr)
+					key = spill_key(key);
 
 				// FAST
 				if(num_entries < cardinality - 1) {
@@ -618,9 +1208,14 @@ class page{
 				else {// FAIR
 					// overflow
 					// create a new node
-					page* sibling = new page(hdr.level); 
-					register int m = (hdr.first_index+(int)ceil(num_entries/2)) & (cardinality - 1);
-					entry_key_t split_key = hdr.records[m].key;
+					page* sibling = new (bt) page(hdr.level); 
+					int left_num = (int)ceil(num_entries/2);
+					if(append && (bt->split_policy == SPLIT_APPEND ||
+								(bt->split_policy == SPLIT_ADAPTIVE && hdr.appends >= APPEND_RUN)))
+						left_num = num_entries - std::max(2, num_entries / APPEND_SPLIT);
+					register int m = (hdr.first_index+left_num) & (cardinality - 1);
+					entry_key_t split_key = (hdr.leftmost_ptr == nullptr) ?
+						separator(records[get_index(m - 1)].key, records[m].key) : records[m].key;
 
 					// migrate half of keys into the sibling
 					int sibling_cnt = 0;
@@ -630,36 +1225,42 @@ class page{
 					if (hdr.leftmost_ptr == nullptr) { // leaf node
 						for (int i=0; i<=move_num; ++i) {
 							int idx = get_index(m + i); 
-							sibling->insert_key(hdr.records[idx].key, hdr.records[idx].ptr, &sibling_cnt, false);
+							sibling->insert_key(records[idx].key, records[idx].ptr, &sibling_cnt, false);
 							// MARK
-							hdr.records[idx].ptr = nullptr;
-							//	hdr.records[idx].key = nullptr;
+							records[idx].ptr = nullptr;
+							//	records[idx].key = nullptr;
 						}
 					}
 					else{ // internal node
 						for(int i=1;i<=move_num;++i){ 
 							int idx = get_index(m + i);
-							sibling->insert_key(hdr.records[idx].key, hdr.records[idx].ptr, &sibling_cnt, false);
-							hdr.records[idx].ptr = nullptr;
-							//	hdr.records[idx].key = nullptr;
+							sibling->insert_key(records[idx].key, records[idx].ptr, &sibling_cnt, false);
+							records[idx].ptr = nullptr;
+							//	records[idx].key = nullptr;
 						}
 						// TODO: have to do with the leftmost_ptr
-						sibling->hdr.leftmost_ptr = (page*) hdr.records[m].ptr;
+						sibling->hdr.leftmost_ptr = (page*) from_pool(records[m].ptr);
 					}
 
 					sibling->hdr.right_sibling_ptr = hdr.right_sibling_ptr;
-					clflush((char *)sibling, sizeof(page));
+					sibling->hdr.appends = hdr.appends;
+					clflush((char *)&sibling->hdr, sizeof(header));
+					sibling->records.flush(0, sibling_cnt);
 
 					hdr.right_sibling_ptr = sibling;
+					++hdr.version;
 
 					clflush((char*) &hdr, sizeof(hdr));
 
 					// set to nullptr
-					hdr.records[m].ptr = nullptr;
-					clflush((char*) &hdr.records[m], sizeof(entry));
-
-					hdr.num_valid_key -= sibling_cnt;
-					clflush((char *)&(hdr.num_valid_key), sizeof(uint32_t));
+					records[m].ptr = nullptr;
+					// the separator at m moves up to the parent, an internal node drops it
+					hdr.num_valid_key -= (hdr.leftmost_ptr == nullptr) ? sibling_cnt : sibling_cnt + 1;
+					// both stores only shrink this node, they share one fence
+					flush_set fs;
+					records.add(fs, m);
+					fs.add((char *)&(hdr.num_valid_key), sizeof(uint32_t));
+					fs.persist();
 
 					num_entries = hdr.num_valid_key;
 
@@ -677,29 +1278,76 @@ class page{
 
 					// Set a new root or insert the split key to the parent
 					if(bt->root == (char *)this) { // only one node can update the root ptr
-						page* new_root = new page((page*)this, split_key, sibling, 
+						page* new_root = new (bt) page((page*)this, split_key, sibling, 
 								hdr.level + 1);
 						bt->setNewRoot((char *)new_root);
 
 					}
 					else {
 						bt->btree_insert_internal(nullptr, split_key, (char *)sibling, 
-								hdr.level + 1);
+								hdr.level + 1, path);
 					}
-
 					return ret;
 				}
 			}
 
-		// Search keys with linear search
-		void linear_search_range
-			(entry_key_t min, entry_key_t max, unsigned long *buf) {
-				int i, off = 0;
-				page *current = this;
+		// Copy the entries of a leaf whose keys are not less than min (greater
+		// than min if after is set), in logical order, and return how many
+		// there are and the right sibling
+		int linear_search_range
+			(entry_key_t min, bool after, entry_key_t *keys, char **values, page **sibling) {
+				int num = count();
+				int lo = lower_bound(min, after);
+				for(int i = lo; i < num; ++i) {
+					keys[i - lo] = records[get_index(hdr.first_index + i)].key;
+					values[i - lo] = records[get_index(hdr.first_index + i)].ptr;
+				}
+				*sibling = hdr.right_sibling_ptr;
+				return num - lo;
+			}
 
-				while(current) {}
+		// Number of keys less than (or, if inclusive, not greater than) key,
+		// i.e. the logical index of the first one that is not
+		inline int lower_bound(entry_key_t key, bool inclusive = false) {
+			int lo = 0, len = count();
+			while(len > 0) {
+				int half = len >> 1;
+				entry_key_t k = records[get_index(hdr.first_index + lo + half)].key;
+				if(inclusive ? !(key < k) : k < key) {
+					lo += half + 1;
+					len -= half + 1;
+				}
+				else
+					len = half;
+			}
+			return lo;
+		}
 
+		// Copy the first hi entries of a leaf, from the last one backwards
+		int reverse_search_range(int hi, entry_key_t *keys, char **values) {
+			for(int i = hi - 1; i >= 0; --i) {
+				keys[hi - 1 - i] = records[get_index(hdr.first_index + i)].key;
+				values[hi - 1 - i] = records[get_index(hdr.first_index + i)].ptr;
 			}
+			return hi;
+		}
+
+		// Child of an internal node at logical index pos, -1 for leftmost_ptr
+		inline page *child(int pos) {
+			if(pos < 0)
+				return hdr.leftmost_ptr;
+			return (page *)from_pool(records[get_index(hdr.first_index + pos)].ptr);
+		}
+
+		// Whether ptr is a child of this internal node
+		bool has_child(char *ptr) {
+			if((char *)hdr.leftmost_ptr == ptr)
+				return true;
+			for(int i = 0; i < count(); ++i)
+				if(from_pool(records[get_index(hdr.first_index + i)].ptr) == ptr)
+					return true;
+			return false;
+		}
 
 		char *linear_search(entry_key_t key) {
                                 int i = 1;
@@ -709,38 +1357,38 @@ class page{
 
                                 if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
                                         for (i = 0; i < count(); ++i)
-                                                if (key == hdr.records[(hdr.first_index + i) & (cardinality - 1)].key) {
-                                                        ret = hdr.records[(hdr.first_index + i) & (cardinality - 1)].ptr;
+                                                if (key == records[(hdr.first_index + i) & (cardinality - 1)].key) {
+                                                        ret = records[(hdr.first_index + i) & (cardinality - 1)].ptr;
                                                         break;
                                                 }
                                         if(ret) {
                                                 return ret;
                                         }
-                                        if((t = (char *)hdr.right_sibling_ptr) != nullptr && key >= ((page *)t)->hdr.records[(((page *)t)->hdr).first_index].key)
+                                        if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
                                                 return t;
 
                                         return nullptr;
                                 }
-                                else { // internal node, which you do not have circular design. -- wangc@2020.03.22
+                                else { // internal node, circular like the leaves
                                         ret = nullptr;
 
-                                        if(key < (k = hdr.records[0].key)) {
+                                        if(count() == 0 || key < (k = records[hdr.first_index].key)) {
                                                 ret = (char *)hdr.leftmost_ptr;
                                         } else {
 
                                                 for(i = 1; i < count(); ++i) {
-                                                        if(key < (k = hdr.records[i].key)) {
-                                                                ret = hdr.records[i - 1].ptr;
+                                                        if(key < (k = records[get_index(hdr.first_index + i)].key)) {
+                                                                ret = from_pool(records[get_index(hdr.first_index + i - 1)].ptr);
                                                                 break;
                                                         }
                                                 }
 
                                                 if(!ret) {
-                                                        ret = hdr.records[i - 1].ptr;
+                                                        ret = from_pool(records[get_index(hdr.first_index + i - 1)].ptr);
                                                 }
                                         }
                                         if ((t = (char *)hdr.right_sibling_ptr) != nullptr) {
-                                                if(key >= ((page *)t)->hdr.records[0].key)
+                                                if(((page *)t)->takes(key))
                                                         return t;
                                         }
 
@@ -754,6 +1402,309 @@ class page{
                                 return nullptr;
                         }
 
+		// Search keys with a branchless binary search over the logical index
+		// (first_index + i) & (cardinality - 1), i.e. the circular array is
+		// treated as a rotated sorted array.
+		char *binary_search(entry_key_t key) {
+			int num = count();
+			int first = hdr.first_index;
+			int lo = 0, len = num;
+			char *t;
+
+			if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
+				// lower bound: first slot whose key is not less than the key
+				while(len > 1) {
+					int half = len >> 1;
+					// prefetch the probes of both possible next steps
+					records.prefetch(get_index(first + lo + (len >> 2) - 1));
+					records.prefetch(get_index(first + lo + half + (len >> 2) - 1));
+					lo += (records[get_index(first + lo + half - 1)].key < key) ? half : 0;
+					len -= half;
+				}
+				if(num > 0) {
+					lo += (records[get_index(first + lo)].key < key);
+					if(lo < num && records[get_index(first + lo)].key == key)
+						return records[get_index(first + lo)].ptr;
+				}
+
+				if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+					return t;
+
+				return nullptr;
+			}
+			else { // internal node
+				// upper bound: number of separators not greater than the key
+				while(len > 1) {
+					int half = len >> 1;
+					// prefetch the probes of both possible next steps
+					records.prefetch(get_index(first + lo + (len >> 2) - 1));
+					records.prefetch(get_index(first + lo + half + (len >> 2) - 1));
+					lo += (records[get_index(first + lo + half - 1)].key <= key) ? half : 0;
+					len -= half;
+				}
+				if(num > 0)
+					lo += (records[get_index(first + lo)].key <= key);
+
+				if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+					return t;
+
+				if(lo == 0 || records[get_index(first + lo - 1)].ptr == nullptr)
+					return (char *)hdr.leftmost_ptr;
+				return from_pool(records[get_index(first + lo - 1)].ptr);
+			}
+		}
+
+		// Count the slots of a contiguous run of n entries whose key is less
+		// than (or, if inclusive, not greater than) the key. The run is sorted,
+		// so the count is the position of the key inside the run. A run is
+		// an array of entries or, with NODE_SOA, of keys.
+		static inline const entry_key_t &key_of(const entry &e) { return e.key; }
+		static inline const entry_key_t &key_of(const entry_key_t &k) { return k; }
+
+		template <typename T>
+		static int run_rank_scalar(T *e, int n, entry_key_t key, bool inclusive) {
+			int i = 0;
+			if(inclusive) {
+				while(i < n && key_of(e[i]) <= key) ++i;
+			}
+			else {
+				while(i < n && key_of(e[i]) < key) ++i;
+			}
+			return i;
+		}
+
+		// 4 keys per compare. Two 32-byte loads cover 4 entries and unpacklo
+		// gathers their keys as k0 k2 k1 k3, which does not matter for counting.
+		__attribute__((target("avx2")))
+		static int run_rank_avx2(entry *e, int n, entry_key_t key, bool inclusive) {
+			__m256i kv = _mm256_set1_epi64x(key);
+			int i = 0, cnt = 0;
+			for(; i + 4 <= n; i += 4) {
+				__m256i a = _mm256_loadu_si256((__m256i *)&e[i]);
+				__m256i b = _mm256_loadu_si256((__m256i *)&e[i + 2]);
+				__m256i keys = _mm256_unpacklo_epi64(a, b);
+				__m256i hit = inclusive ?
+					_mm256_xor_si256(_mm256_cmpgt_epi64(keys, kv), _mm256_set1_epi64x(-1)) :
+					_mm256_cmpgt_epi64(kv, keys);
+				int mask = _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+				cnt += __builtin_popcount(mask);
+				if(mask != 0xF)
+					return cnt;
+			}
+			return cnt + run_rank_scalar(e + i, n - i, key, inclusive);
+		}
+
+		__attribute__((target("avx2")))
+		static int run_rank_avx2(entry_key_t *k, int n, entry_key_t key, bool inclusive) {
+			__m256i kv = _mm256_set1_epi64x(key);
+			int i = 0, cnt = 0;
+			for(; i + 4 <= n; i += 4) {
+				__m256i keys = _mm256_loadu_si256((__m256i *)&k[i]);
+				__m256i hit = inclusive ?
+					_mm256_xor_si256(_mm256_cmpgt_epi64(keys, kv), _mm256_set1_epi64x(-1)) :
+					_mm256_cmpgt_epi64(kv, keys);
+				int mask = _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+				cnt += __builtin_popcount(mask);
+				if(mask != 0xF)
+					return cnt;
+			}
+			return cnt + run_rank_scalar(k + i, n - i, key, inclusive);
+		}
+
+		// 8 keys per compare, the keys of two 64-byte loads are gathered with
+		// one permute.
+		__attribute__((target("avx512f")))
+		static int run_rank_avx512(entry *e, int n, entry_key_t key, bool inclusive) {
+			const __m512i key_idx = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+			__m512i kv = _mm512_set1_epi64(key);
+			int i = 0, cnt = 0;
+			for(; i + 8 <= n; i += 8) {
+				__m512i a = _mm512_loadu_si512((void *)&e[i]);
+				__m512i b = _mm512_loadu_si512((void *)&e[i + 4]);
+				__m512i keys = _mm512_permutex2var_epi64(a, key_idx, b);
+				__mmask8 mask = inclusive ? _mm512_cmple_epi64_mask(keys, kv) :
+					_mm512_cmplt_epi64_mask(keys, kv);
+				cnt += __builtin_popcount(mask);
+				if(mask != 0xFF)
+					return cnt;
+			}
+			return cnt + run_rank_avx2(e + i, n - i, key, inclusive);
+		}
+
+		__attribute__((target("avx512f")))
+		static int run_rank_avx512(entry_key_t *k, int n, entry_key_t key, bool inclusive) {
+			__m512i kv = _mm512_set1_epi64(key);
+			int i = 0, cnt = 0;
+			for(; i + 8 <= n; i += 8) {
+				__m512i keys = _mm512_loadu_si512((void *)&k[i]);
+				__mmask8 mask = inclusive ? _mm512_cmple_epi64_mask(keys, kv) :
+					_mm512_cmplt_epi64_mask(keys, kv);
+				cnt += __builtin_popcount(mask);
+				if(mask != 0xFF)
+					return cnt;
+			}
+			return cnt + run_rank_avx2(k + i, n - i, key, inclusive);
+		}
+
+		// the kernels compare 64-bit signed keys, other key types are counted
+		// by the scalar loop
+		template <typename T>
+		static inline int run_rank(T *e, int n, entry_key_t key, bool inclusive) {
+			return run_rank(e, n, key, inclusive, std::integral_constant<bool,
+					std::is_integral<entry_key_t>::value && std::is_signed<entry_key_t>::value &&
+					sizeof(entry_key_t) == 8>());
+		}
+
+		template <typename T>
+		static inline int run_rank(T *e, int n, entry_key_t key, bool inclusive, std::false_type) {
+			return run_rank_scalar(e, n, key, inclusive);
+		}
+
+		template <typename T>
+		static inline int run_rank(T *e, int n, entry_key_t key, bool inclusive, std::true_type) {
+			switch(simd_level) {
+				case SIMD_AVX512:
+					return run_rank_avx512(e, n, key, inclusive);
+				case SIMD_AVX2:
+					return run_rank_avx2(e, n, key, inclusive);
+				default:
+					return run_rank_scalar(e, n, key, inclusive);
+			}
+		}
+
+		// Position of the key in the logical order of this node. The circular
+		// array is searched as at most two contiguous runs split at the wrap
+		// point.
+		inline int rank(entry_key_t key, bool inclusive) {
+			int num = count();
+			int first = hdr.first_index;
+			int run = (num < cardinality - first) ? num : cardinality - first;
+			int pos = run_rank(records.run(first), run, key, inclusive);
+			if(pos == run && num > run)
+				pos += run_rank(records.run(0), num - run, key, inclusive);
+			return pos;
+		}
+
+		// Search keys with the vectorized comparison kernel
+		char *simd_search(entry_key_t key) {
+			int first = hdr.first_index;
+			int pos;
+			char *t;
+
+			if(hdr.leftmost_ptr == nullptr) { // Search a leaf node
+				pos = rank(key, false);
+				if(pos < count() && records[get_index(first + pos)].key == key)
+					return records[get_index(first + pos)].ptr;
+
+				if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+					return t;
+
+				return nullptr;
+			}
+			else { // internal node
+				pos = rank(key, true);
+
+				if((t = (char *)hdr.right_sibling_ptr) != nullptr && ((page *)t)->takes(key))
+					return t;
+
+				if(pos == 0 || records[get_index(first + pos - 1)].ptr == nullptr)
+					return (char *)hdr.leftmost_ptr;
+				return from_pool(records[get_index(first + pos - 1)].ptr);
+			}
+		}
+
+		// Write back the slots at logical [from, to) from first_index, the
+		// fence is left to the caller
+		void flush_slots(int from, int to) {
+			char *last[2] = {nullptr, nullptr};
+			if(flush_insn == FLUSH_CLFLUSH)
+				mfence();
+			for(int i = from; i < to; ++i)
+				records.write_back(get_index(hdr.first_index + i), last);
+		}
+
+		// Count an insert of key in hdr.appends: one among the last
+		// 1/APPEND_SPLIT of the keys is an append, anything else halves the run
+		inline bool count_append(entry_key_t key) {
+			int num = count();
+			bool append = num == 0 || key > records[get_index(hdr.first_index + num - 1 -
+					num / APPEND_SPLIT)].key;
+			hdr.appends = append ? (hdr.appends < APPEND_RUN ? hdr.appends + 1 : APPEND_RUN) :
+				hdr.appends >> 1;
+			return append;
+		}
+
+		// Insert num sorted keys that all belong to this node and fit in it.
+		// The keys below the first entry and above the last one go to the free
+		// slots in front of and behind the entries, where they stay unreachable
+		// until the header takes them in: one fence covers those slots, another
+		// the header. A bulk merge among the entries would overwrite slots the
+		// old header still points at, so the keys falling between entries are
+		// shifted in one at a time by insert_key.
+		void insert_sorted(entry_key_t *keys, char **values, int num) {
+			// the batch counts as the single inserts it replaces
+			for(int i = 0; i < num; ++i)
+				count_append(keys[i]);
+
+			int cnt = count();
+			int front = 0, back = num;
+			if(cnt > 0) {
+				while(front < num && keys[front] < records[hdr.first_index].key)
+					++front;
+				while(back > front && keys[back - 1] > records[get_last_idx()].key)
+					--back;
+			}
+			else
+				back = 0;
+
+			for(int i = 0; i < front; ++i) {
+				slot e = records[get_index(hdr.first_index - front + i)];
+				e.key = keys[i];
+				e.ptr = values[i];
+			}
+			for(int i = back; i < num; ++i) {
+				slot e = records[get_index(hdr.first_index + cnt + i - back)];
+				e.key = keys[i];
+				e.ptr = values[i];
+			}
+			if(front > 0 || back < num) {
+				flush_slots(-front, 0);
+				flush_slots(cnt, cnt + num - back);
+				persist_fence();
+
+				hdr.num_valid_key += front + num - back;
+				hdr.first_index = get_index(hdr.first_index - front);
+				clflush((char *)&hdr, sizeof(header));
+			}
+
+			for(int i = front; i < back; ++i) {
+				int n = count();
+				insert_key(keys[i], values[i], &n);
+			}
+		}
+
+// Prefetch the slots a search of this node starts from, once the
+		// header is in the cache
+		inline void prefetch_records() {
+			int num = count();
+			int first = hdr.first_index;
+			records.prefetch(first);
+			records.prefetch(get_index(first + (num >> 2)));
+			records.prefetch(get_index(first + (num >> 1)));
+			records.prefetch(get_index(first + num - (num >> 2)));
+		}
+
+		inline char *search(entry_key_t key, search_mode_t mode) {
+			switch(mode) {
+				case BINARY_SEARCH:
+					return binary_search(key);
+				case SIMD_SEARCH:
+					return simd_search(key);
+				default:
+					return linear_search(key);
+			}
+		}
+
 		// print a node 
 		void print() {
 			if(hdr.leftmost_ptr == nullptr) 
@@ -766,16 +1717,18 @@ class page{
 			printf("num_valid_key: %d\n", hdr.num_valid_key);
 
 			if(hdr.leftmost_ptr!=nullptr) 
-				printf("%x ",hdr.leftmost_ptr);
+				printf("%x ",(page *)hdr.leftmost_ptr);
 
 			for(int i=0; i < hdr.num_valid_key;++i){
 				int idx = get_index(hdr.first_index + i);
-				printf("K:%ld, ", hdr.records[idx].key);
-				printf("V:%x. ",hdr.records[idx].ptr);
+				printf("K:");
+				print_key(records[idx].key);
+				printf(", ");
+				printf("V:%x. ",records[idx].ptr);
 			}
 
 			printf("\n");
-			printf("Right_sibling: %x ", hdr.right_sibling_ptr);
+			printf("Right_sibling: %x ", (page *)hdr.right_sibling_ptr);
 
 			printf("\n");
 		}
@@ -791,112 +1744,718 @@ class page{
 				((page*) hdr.leftmost_ptr)->printAll();
 				for(int i=0;i < hdr.num_valid_key;++i){
 					int idx = get_index(hdr.first_index + i);
-					((page*) hdr.records[idx].ptr)->printAll();
+					((page*) from_pool(records[idx].ptr))->printAll();
 				}
 			}
 		}
 };
 
+/*
+ *  class btree_iterator
+ */
+// Forward scan in key order: seek() positions the iterator at the first key
+// not less than the given one, next() steps through the following keys
+// across right_sibling_ptr. The entries of one leaf are copied out at a
+// time, and the next leaf is prefetched while they are consumed.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class btree_iterator_t{
+	private:
+		typedef Key entry_key_t;
+		typedef page_t<Key, Value, Cardinality, Layout> page;
+		typedef btree_t<Key, Value, Cardinality, Layout> btree;
+		static const int cardinality = Cardinality;
+		static const int count_in_line = records_t<Key, Cardinality, Layout>::per_line;
+
+		btree *bt;
+		page *leaf;     // leaf the buffered entries were copied from
+		page *sibling;  // its right sibling when they were copied
+		int pos, num;
+		entry_key_t keys[cardinality];
+		char *values[cardinality];
+
+		void fill(entry_key_t min, bool after);
+
+	public:
+		btree_iterator_t(btree *bt) : bt(bt), leaf(nullptr), sibling(nullptr), pos(0), num(0) {}
+		void seek(entry_key_t key);
+		void next();
+		bool valid() { return pos < num; }
+		entry_key_t key() { return keys[pos]; }
+		Value value() { return (Value)values[pos]; }
+};
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_iterator_t<Key, Value, Cardinality, Layout>::seek(entry_key_t key) {
+	page *p = (page *)bt->root;
+	while(p->hdr.leftmost_ptr != nullptr)
+		p = (page *)p->search(key, bt->search_mode);
+	leaf = p;
+	fill(key, false);
+}
+
+// Buffer the keys not less than min, or greater than min if after is set,
+// starting at the current leaf and moving right past leaves that hold none
+// of them
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_iterator_t<Key, Value, Cardinality, Layout>::fill(entry_key_t min, bool after) {
+	pos = num = 0;
+	while(leaf) {
+		num = leaf->linear_search_range(min, after, keys, values, &sibling);
+		if(sibling)
+			__builtin_prefetch(sibling);
+		if(num > 0)
+			return;
+		leaf = sibling;
+	}
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_iterator_t<Key, Value, Cardinality, Layout>::next() {
+	if(++pos < num) {
+		// the header is in by now, fetch the first entries of the next leaf
+		if(pos == (num >> 1) && sibling) {
+			for(int i = 0; i < 4; ++i)
+				sibling->records.prefetch_slot(sibling->get_index(
+							sibling->hdr.first_index + i * count_in_line));
+		}
+		return;
+	}
+	if(keys[num - 1] == std::numeric_limits<entry_key_t>::max())
+		return;
+	leaf = sibling;
+	fill(keys[num - 1], true);
+}
+
+/*
+ *  class btree_reverse_iterator
+ */
+// Backward scan in key order: seek() positions the iterator at the last key
+// less than the given one, next() steps to smaller keys. Leaves only link
+// to the right, so the iterator keeps the path from the root with the child
+// taken at each level and steps to the previous leaf through the lowest
+// ancestor that has a child further left. Each leaf is read backwards from
+// its last logical index.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+class btree_reverse_iterator_t{
+	private:
+		typedef Key entry_key_t;
+		typedef page_t<Key, Value, Cardinality, Layout> page;
+		typedef btree_t<Key, Value, Cardinality, Layout> btree;
+		static const int cardinality = Cardinality;
+
+		btree *bt;
+		std::vector<std::pair<page *, int> > path;  // internal nodes and the child taken
+		page *leaf;
+		int pos, num;
+		entry_key_t keys[cardinality];
+		char *values[cardinality];
+
+		void descend(page *p, entry_key_t max, bool rightmost);
+		void previous_leaf();
+
+	public:
+		btree_reverse_iterator_t(btree *bt) : bt(bt), leaf(nullptr), pos(0), num(0) {}
+		void seek(entry_key_t key);
+		void next();
+		bool valid() { return pos < num; }
+		entry_key_t key() { return keys[pos]; }
+		Value value() { return (Value)values[pos]; }
+};
+
+// Walk down from p to the leaf holding the largest key less than max, or
+// along the rightmost children, and buffer the keys below max
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_reverse_iterator_t<Key, Value, Cardinality, Layout>::descend(page *p, entry_key_t max, bool rightmost) {
+	while(p->hdr.leftmost_ptr != nullptr) {
+		int c = rightmost ? p->count() - 1 : p->lower_bound(max) - 1;
+		path.push_back(std::make_pair(p, c));
+		p = p->child(c);
+	}
+	leaf = p;
+	pos = 0;
+	num = leaf->reverse_search_range(rightmost ? leaf->count() : leaf->lower_bound(max),
+			keys, values);
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_reverse_iterator_t<Key, Value, Cardinality, Layout>::previous_leaf() {
+	num = pos = 0;
+	while(!path.empty()) {
+		std::pair<page *, int> &top = path.back();
+		if(top.second < 0) {
+			path.pop_back();
+			continue;
+		}
+		page *p = top.first->child(--top.second);
+		descend(p, entry_key_t(), true);
+		if(num > 0)
+			return;
+	}
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_reverse_iterator_t<Key, Value, Cardinality, Layout>::seek(entry_key_t key) {
+	path.clear();
+	descend((page *)bt->root, key, false);
+	if(num == 0)
+		previous_leaf();
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_reverse_iterator_t<Key, Value, Cardinality, Layout>::next() {
+	if(++pos < num) {
+		// the leaf to the left hangs off the parent, fetch its header
+		if(pos == (num >> 1) && !path.empty() && path.back().second >= 0)
+			__builtin_prefetch(path.back().first->child(path.back().second - 1));
+		return;
+	}
+	previous_leaf();
+}
+
 /*
  *  class btree
  */
-btree::btree(){
-	root = (char*)new page();
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+btree_t<Key, Value, Cardinality, Layout>::btree_t(search_mode_t mode, pool_header *pool){
+	this->pool = pool;
+	search_mode = mode;
+	split_policy = SPLIT_ADAPTIVE;
+	use_finger = false;
+	root = (char*)new (this) page();
 	height = 1;
 }
 
-void btree::setNewRoot(char *new_root) {
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+thread_local typename btree_t<Key, Value, Cardinality, Layout>::finger_t
+btree_t<Key, Value, Cardinality, Layout>::finger;
+
+// Map the pool file at path, creating and formatting it with pool_size
+// bytes if it is new, and return the tree stored in it. Reattaching an
+// existing pool only maps the file. Pages and the root are addressed
+// relative to the mapping, so it may land anywhere. A file without the
+// pool magic is only formatted again when a format was cut short, which
+// leaves nothing but the header and the first root page; any other file
+// is refused, and so is a second pool while one is attached.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+btree_t<Key, Value, Cardinality, Layout> *btree_t<Key, Value, Cardinality, Layout>::open(const char *path, size_t pool_size) {
+	static_assert(std::is_integral<Key>::value, "string keys are not kept in a pool");
+	if(pool_base) {
+		fprintf(stderr, "a pool is attached already, close it first\n");
+		return nullptr;
+	}
+	int fd = ::open(path, O_RDWR | O_CREAT, 0666);
+	if(fd < 0) {
+		perror("pool open");
+		return nullptr;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		perror("pool fstat");
+		::close(fd);
+		return nullptr;
+	}
+	const size_t min_size = pool_data_start + sizeof(page);
+	bool fresh = (st.st_size == 0);
+	if(fresh) {
+		if(pool_size < min_size) {
+			fprintf(stderr, "pool size %lu is below the minimum of %lu bytes\n",
+					(unsigned long)pool_size, (unsigned long)min_size);
+			::close(fd);
+			return nullptr;
+		}
+		if(ftruncate(fd, pool_size) != 0) {
+			perror("pool ftruncate");
+			::close(fd);
+			return nullptr;
+		}
+	}
+	else if((size_t)st.st_size < min_size) {
+		fprintf(stderr, "%s is too small to be a pool\n", path);
+		::close(fd);
+		return nullptr;
+	}
+	else {
+		pool_size = st.st_size;
+	}
+
+	void *addr = MAP_FAILED;
+#if defined(MAP_SHARED_VALIDATE) && defined(MAP_SYNC)
+	// DAX file system: stores are durable once flushed from the cache
+	addr = mmap(nullptr, pool_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED_VALIDATE | MAP_SYNC, fd, 0);
+#endif
+	if(addr == MAP_FAILED)
+		addr = mmap(nullptr, pool_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(addr == MAP_FAILED) {
+		perror("pool mmap");
+		return nullptr;
+	}
+
+	static_assert(sizeof(btree) <= sizeof(pool_header::tree), "btree does not fit the pool header");
+	pool_header *hdr = (pool_header *)addr;
+	bool format = fresh || (hdr->magic == 0 &&
+			pool_zero((char *)addr + min_size, pool_size - min_size));
+	if(!format && hdr->magic != POOL_MAGIC) {
+		fprintf(stderr, "%s is not a pool\n", path);
+		munmap(addr, pool_size);
+		return nullptr;
+	}
+	if(!format && hdr->size > pool_size) {
+		fprintf(stderr, "pool was truncated to %lu of %lu bytes\n",
+				(unsigned long)pool_size, (unsigned long)hdr->size);
+		munmap(addr, pool_size);
+		return nullptr;
+	}
+	if(!format && hdr->node_size != sizeof(page)) {
+		fprintf(stderr, "pool was created with %lu-byte nodes, not %lu\n",
+				(unsigned long)hdr->node_size, (unsigned long)sizeof(page));
+		munmap(addr, pool_size);
+		return nullptr;
+	}
+	if(!format && hdr->node_layout != Layout) {
+		fprintf(stderr, "pool was created with %s nodes\n",
+				hdr->node_layout == NODE_SOA ? "NODE_SOA" : "NODE_AOS");
+		munmap(addr, pool_size);
+		return nullptr;
+	}
+
+	pool_base = (char *)addr;
+	pool_end = pool_base + pool_size;
+	btree *bt = (btree *)hdr->tree;
+
+	if(format) {
+		hdr->size = pool_size;
+		hdr->next = pool_data_start;
+		hdr->free_list = 0;
+		hdr->node_size = sizeof(page);
+		hdr->node_layout = Layout;
+		new (bt) btree(LINEAR_SEARCH, hdr);
+		clflush((char *)hdr, sizeof(pool_header));
+
+		hdr->magic = POOL_MAGIC;
+		clflush((char *)&hdr->magic, sizeof(uint64_t));
+	}
+
+	// the mapping moves between runs, the tree finds its pool anew
+	bt->pool = hdr;
+	return bt;
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::close(btree *bt) {
+	if(finger.tree == bt)
+		finger.tree = nullptr;
+	if(bt->pool) {
+		msync(pool_base, bt->pool->size, MS_SYNC);
+		munmap(pool_base, bt->pool->size);
+		pool_base = pool_end = nullptr;
+	}
+	else {
+		delete bt;
+	}
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::setNewRoot(char *new_root) {
 	this->root = (char*)new_root;
 	clflush((char*)&(this->root),sizeof(char*));
 	++height;
 }
 
-char *btree::btree_search(entry_key_t key){
-	page* p = (page*)root;
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::free_page(page *p) {
+	// a finger never outlives a page it holds
+	if(finger.tree == this && finger.holds(p))
+		finger.tree = nullptr;
+	page::operator delete(p, this);
+}
+
+// Leaf key belongs to. The leaf of the thread's finger is taken as long as
+// it kept its version, i.e. neither split nor took in a sibling, and key
+// lies between the separators around it. A page is never freed under a
+// finger, see free_page. Otherwise a descent from the root finds the leaf
+// and records them.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+typename btree_t<Key, Value, Cardinality, Layout>::page *
+btree_t<Key, Value, Cardinality, Layout>::finger_leaf(entry_key_t key) {
+	finger_t &f = finger;
+	if(f.tree == this && f.leaf->hdr.version == f.version && !f.leaf->hdr.is_deleted &&
+			(!f.has_low || !(key < f.low)) && (!f.has_high || key < f.high))
+		return f.leaf;
 
+	page *p = (page *)root;
+	f.has_low = f.has_high = false;
+	f.path.start(p);
 	while(p->hdr.leftmost_ptr != nullptr) {
-		p = (page *)p->linear_search(key);
+		f.path.visit(p);
+		int pos = p->lower_bound(key, true);
+		// a level below only narrows the range a level above left
+		if(pos > 0) {
+			f.low = p->records[p->get_index(p->hdr.first_index + pos - 1)].key;
+			f.has_low = true;
+		}
+		if(pos < p->count()) {
+			f.high = p->records[p->get_index(p->hdr.first_index + pos)].key;
+			f.has_high = true;
+		}
+		p = p->child(pos - 1);
+	}
+	f.tree = this;
+	f.leaf = p;
+	f.version = p->hdr.version;
+	return p;
+}
+
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+Value btree_t<Key, Value, Cardinality, Layout>::btree_search(entry_key_t key){
+	page* p;
+
+	if(use_finger)
+		p = finger_leaf(key);
+	else {
+		p = (page*)root;
+		while(p->hdr.leftmost_ptr != nullptr) {
+			p = (page *)p->search(key, search_mode);
+		}
 	}
 
 	page *t;
-	while((t = (page *)p->linear_search(key)) == p->hdr.right_sibling_ptr) {
+	while((t = (page *)p->search(key, search_mode)) == p->hdr.right_sibling_ptr) {
 		p = t;
 		if(!p) {
 			break;
 		}
 	}
 
-	if(!t || (char *)t != (char *)key) {
-		printf("NOT FOUND %lu, t = %x\n", key, t);
-		return nullptr;
+	if(!t) {
+		printf("NOT FOUND ");
+		print_key(key);
+		printf("\n");
+		return Value();
 	}
 
-	return (char *)t;
+	return (Value)(char *)t;
+}
+
+#define MULTI_GET_GROUP 16
+
+// Look up n keys, out[i] receives what btree_search(keys[i]) returns
+// without the message for missing keys. The keys go down in groups level
+// by level: every lookup of a group takes its step in a node prefetched
+// the round before and prefetches the next one, so the misses of the
+// group overlap instead of following each other.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::multi_get(entry_key_t *keys, int n, Value *out) {
+	page *nodes[MULTI_GET_GROUP];
+
+	for(int base = 0; base < n; base += MULTI_GET_GROUP) {
+		int g = (n - base < MULTI_GET_GROUP) ? n - base : MULTI_GET_GROUP;
+		entry_key_t *k = keys + base;
+		page *r = (page *)root;
+		for(int i = 0; i < g; ++i)
+			nodes[i] = r;
+
+		bool internal = r->hdr.leftmost_ptr != nullptr;
+		while(internal) {
+			internal = false;
+			for(int i = 0; i < g; ++i) {
+				if(nodes[i]->hdr.leftmost_ptr == nullptr)
+					continue;
+				nodes[i] = (page *)nodes[i]->search(k[i], search_mode);
+				__builtin_prefetch(nodes[i]);
+				internal = true;
+			}
+			// the headers are on their way, fetch the slots behind them
+			for(int i = 0; i < g; ++i)
+				nodes[i]->prefetch_records();
+		}
+
+		for(int i = 0; i < g; ++i) {
+			page *p = nodes[i], *t;
+			while((t = (page *)p->search(k[i], search_mode)) == p->hdr.right_sibling_ptr) {
+				p = t;
+				if(!p)
+					break;
+			}
+			out[base + i] = (Value)(char *)t;
+		}
+	}
 }
 
 // insert the key in the leaf node
-void btree::btree_insert(entry_key_t key, char* right){ //need to be string
-	page* p = (page*)root;
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_insert(entry_key_t key, Value right){ //need to be string
+	page* p;
+	path_t path, *parents = &path;
+
+	do {
+		if(use_finger) {
+			p = finger_leaf(key);
+			parents = &finger.path;
+		}
+		else {
+			p = (page*)root;
+			path.start(p);
+			while(p->hdr.leftmost_ptr != nullptr) {
+				path.visit(p);
+				p = (page*)p->search(key, search_mode);
+			}
+		}
+	} while(!p->store(this, nullptr, key, (char *)right, true, nullptr, parents)); // store 
+}
 
-	while(p->hdr.leftmost_ptr != nullptr) {
-		p = (page*)p->linear_search(key);
+// Insert a batch of n keys. The batch is sorted, and every leaf it lands
+// in is reached once and takes all of its keys that fit with one
+// insert_sorted. A full leaf gets the next key through btree_insert, which
+// splits it, and the rest of its keys on the next pass.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::multi_put(entry_key_t *keys, Value *values, int n) {
+	std::vector<std::pair<entry_key_t, char *> > batch(n);
+	for(int i = 0; i < n; ++i)
+		batch[i] = std::make_pair(keys[i], (char *)values[i]);
+	std::sort(batch.begin(), batch.end());
+
+	entry_key_t run_keys[cardinality];
+	char *run_values[cardinality];
+	for(int i = 0; i < n; ) {
+		entry_key_t key = batch[i].first;
+		// the keys below the separator that follows the leaf belong here; it
+		// may sort before the first key of the right sibling
+		page *p = (page *)root;
+		bool bounded = false;
+		entry_key_t bound = entry_key_t();
+		while(p->hdr.leftmost_ptr != nullptr) {
+			int pos = p->lower_bound(key, true);
+			if(pos < p->count()) {
+				bound = p->records[p->get_index(p->hdr.first_index + pos)].key;
+				bounded = true;
+			}
+			p = p->child(pos - 1);
+		}
+
+		int room = cardinality - 1 - p->count();
+		int num = 0;
+		for(; num < room && i + num < n && (!bounded || batch[i + num].first < bound); ++num) {
+			run_keys[num] = spill_key(batch[i + num].first);
+			run_values[num] = batch[i + num].second;
+		}
+
+		if(num == 0) {
+			btree_insert(key, (Value)batch[i].second);
+			++i;
+			continue;
+		}
+		p->insert_sorted(run_keys, run_values, num);
+		i += num;
 	}
+}
 
-	if(!p->store(this, nullptr, key, right, true)) { // store 
-		btree_insert(key, right);
+// Run fn(from, to) over [0, num) split into contiguous ranges, one per thread
+template <typename Fn>
+static void parallel_ranges(long num, int n_threads, Fn fn) {
+	if(n_threads > num)
+		n_threads = num;
+	if(n_threads <= 1) {
+		fn(0L, num);
+		return;
 	}
+	std::vector<std::future<void> > futures;
+	for(int t = 0; t < n_threads; ++t)
+		futures.push_back(std::async(std::launch::async, fn,
+					num * t / n_threads, num * (t + 1) / n_threads));
+	for(auto &&f : futures)
+		f.get();
+}
+
+// Start of the i-th of num groups when total items are spread evenly
+static inline long bulk_group_start(long i, long total, long num) {
+	return i * (total / num) + (i < total % num ? i : total % num);
 }
 
-// store the key into the node at the given level 
-void btree::btree_insert_internal
-(char *left, entry_key_t key, char *right, uint32_t level) {
+// Link the nodes of one level built by bulk_load and flush each of them.
+// Every node of the level exists already, so the links across the ranges
+// built by different threads are set like any other.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::bulk_link_level(std::vector<page *> &nodes, int n_threads) {
+	parallel_ranges(nodes.size(), n_threads, [&nodes](long from, long to) {
+			for(long i = from; i < to; ++i) {
+				if(i + 1 < (long)nodes.size())
+					nodes[i]->hdr.right_sibling_ptr = nodes[i + 1];
+				nodes[i]->flush_node();
+			}
+		});
+}
+
+// Build the level above nodes, a parent with k entries covers k + 1
+// children. low_keys holds the smallest key under each node and is
+// replaced by the one of each parent.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+std::vector<page_t<Key, Value, Cardinality, Layout> *> btree_t<Key, Value, Cardinality, Layout>::bulk_build_parents(std::vector<page *> &nodes,
+		std::vector<entry_key_t> &low_keys, uint32_t level, long per_node, int n_threads) {
+	long m = nodes.size();
+	long num_parents = (m + per_node) / (per_node + 1);
+	std::vector<page *> parents(num_parents);
+	std::vector<entry_key_t> parent_keys(num_parents);
+	parallel_ranges(num_parents, n_threads, [&](long from, long to) {
+			for(long i = from; i < to; ++i) {
+				long c = bulk_group_start(i, m, num_parents);
+				int cnt = bulk_group_start(i + 1, m, num_parents) - c - 1;
+				int base = (cardinality - cnt) >> 1;
+				page *node = new (this) page(level);
+				node->hdr.leftmost_ptr = nodes[c];
+				node->hdr.first_index = base;
+				for(int j = 0; j < cnt; ++j) {
+					node->records[base + j].key = low_keys[c + 1 + j];
+					node->records[base + j].ptr = to_pool((char *)nodes[c + 1 + j]);
+				}
+				node->hdr.num_valid_key = cnt;
+				parent_keys[i] = low_keys[c];
+				parents[i] = node;
+			}
+		});
+	bulk_link_level(parents, n_threads);
+	low_keys.swap(parent_keys);
+	return parents;
+}
+
+// Build the tree bottom-up from (key, value) pairs sorted by key. Nodes
+// are filled to fill_factor and their entries are centered in the circular
+// array, so later inserts find room for a shift on either side. Each node
+// is flushed once it is complete, the root pointer last. A tree that
+// already holds keys gets them through btree_insert instead.
+//
+// With n_threads > 1 every level is split into contiguous runs of nodes
+// built by separate threads; the input is partitioned by the leaf each
+// pair lands in. The pool allocator is not thread-safe, so a tree in a
+// pool is always loaded by one thread.
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+template <typename It>
+void btree_t<Key, Value, Cardinality, Layout>::bulk_load(It first, It last, double fill_factor, int n_threads) {
+	page *old_root = (page *)root;
+	if(old_root->count() != 0 || old_root->hdr.leftmost_ptr != nullptr) {
+		for(; first != last; ++first)
+			btree_insert(first->first, first->second);
+		return;
+	}
+
+	long n = std::distance(first, last);
+	if(n == 0)
+		return;
+	if(pool)
+		n_threads = 1;
+
+	long per_node = (long)((cardinality - 1) * fill_factor);
+	if(per_node < 2)
+		per_node = 2;
+	if(per_node > cardinality - 1)
+		per_node = cardinality - 1;
+
+	// leaves, with the entries spread evenly over the fewest nodes
+	long num_nodes = (n + per_node - 1) / per_node;
+	std::vector<page *> nodes(num_nodes);
+	std::vector<entry_key_t> low_keys(num_nodes);
+	parallel_ranges(num_nodes, n_threads, [&](long from, long to) {
+			It it = first;
+			std::advance(it, bulk_group_start(from, n, num_nodes));
+			for(long i = from; i < to; ++i) {
+				int cnt = bulk_group_start(i + 1, n, num_nodes) - bulk_group_start(i, n, num_nodes);
+				int base = (cardinality - cnt) >> 1;
+				page *leaf = new (this) page(0);
+				leaf->hdr.first_index = base;
+				for(int j = 0; j < cnt; ++j, ++it) {
+					leaf->records[base + j].key = spill_key(it->first);
+					leaf->records[base + j].ptr = (char *)it->second;
+				}
+				leaf->hdr.num_valid_key = cnt;
+				low_keys[i] = leaf->records[base].key;
+				nodes[i] = leaf;
+			}
+		});
+	bulk_link_level(nodes, n_threads);
+	for(long i = 1; i < num_nodes; ++i)
+		low_keys[i] = separator(nodes[i - 1]->records[nodes[i - 1]->get_last_idx()].key, low_keys[i]);
+
+	uint32_t level = 0;
+	while(nodes.size() > 1) {
+		std::vector<page *> parents = bulk_build_parents(nodes, low_keys, ++level, per_node, n_threads);
+		nodes.swap(parents);
+	}
+
+	root = (char *)nodes[0];
+	clflush((char *)&root, sizeof(root));
+	height = level + 1;
+	free_page(old_root);
+}
+
+// store the key into the node at the given level, the one the descent
+// in path passed through if there is one
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_insert_internal
+(char *left, entry_key_t key, char *right, uint32_t level, path_t *path) {
 	if(level > ((page *)root)->hdr.level)
 		return;
 
-	page *p = (page *)this->root;
+	page *p = path ? path->at(level) : nullptr;
 
-	while(p->hdr.level > level) 
-		p = (page *)p->linear_search(key);
+	if(!p) {
+		p = (page *)this->root;
+		while(p->hdr.level > level) 
+			p = (page *)p->search(key, search_mode);
+	}
 
-	if(!p->store(this, nullptr, key, right, true)) {
+	if(!p->store(this, nullptr, key, to_pool(right), true, nullptr, path)) {
 		btree_insert_internal(left, key, right, level);
 	}
 }
 
-void btree::btree_delete(entry_key_t key) {
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_delete(entry_key_t key) {
 	page* p = (page*)root;
+	path_t path;
 
+	path.start(p);
 	while(p->hdr.leftmost_ptr != nullptr){
-		p = (page*) p->linear_search(key);
+		path.visit(p);
+		p = (page*) p->search(key, search_mode);
 	}
 
 	page *t;
-	while((t = (page *)p->linear_search(key)) == p->hdr.right_sibling_ptr) {
+	while((t = (page *)p->search(key, search_mode)) == p->hdr.right_sibling_ptr) {
 		p = t;
 		if(!p)
 			break;
 	}
 
 	if(p) {
-		if(!p->remove(this, key)) {
+		if(!p->remove(this, key, false, true, &path)) {
 			btree_delete(key);
 		}
 	}
 	else {
-		printf("not found the key to delete %lu\n", key);
+		printf("not found the key to delete ");
+		print_key(key);
+		printf("\n");
 	}
 }
 
-void btree::btree_delete_internal
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::btree_delete_internal
 (entry_key_t key, char *ptr, uint32_t level, entry_key_t *deleted_key, 
- bool *is_leftmost_node, page **left_sibling, page** left_left_sibling) {
+ bool *is_leftmost_node, page **left_sibling, page** left_left_sibling, path_t *path) {
 	if(level > ((page *)this->root)->hdr.level)
 		return;
 	
-	page *p = (page*)(this->root);
-
-	while(p->hdr.level > level) {
-		p = (page *)p->linear_search(key);
+	// the node the descent passed through is the parent unless an earlier
+	// merge of this delete moved ptr, or ptr is a sibling off the path
+	page *p = path ? path->at(level) : nullptr;
+
+	if(!p || !p->has_child(ptr)) {
+		p = (page*)(this->root);
+		while(p->hdr.level > level) {
+			p = (page *)p->search(key, search_mode);
+		}
 	}
 	
 	if((char *)p->hdr.leftmost_ptr == ptr) {
@@ -910,19 +2469,19 @@ void btree::btree_delete_internal
 	
 	for(int i=0; i < p->hdr.num_valid_key; i++) {
 		int idx = p->get_index(p->hdr.first_index + i);
-		if(p->hdr.records[idx].ptr == ptr) {
+		if(from_pool(p->records[idx].ptr) == ptr) {
 	    if(idx == p->hdr.first_index) {
 				
-				if((char *)p->hdr.leftmost_ptr != p->hdr.records[idx].ptr) {
+				if((char *)p->hdr.leftmost_ptr != from_pool(p->records[idx].ptr)) {
 					
-					*deleted_key = p->hdr.records[idx].key;
-					page* tmp = (page*)p->hdr.records[idx].ptr;
+					*deleted_key = p->records[idx].key;
+					page* tmp = (page*)from_pool(p->records[idx].ptr);
 					*left_sibling = p->hdr.leftmost_ptr;
 					int num_keys = (tmp)->count();
 					if (((*left_sibling)->count() < (int)((cardinality-1) *0.5) && num_keys < (int)((cardinality-1) *0.5))
 					){
 						
-						p->remove(this, *deleted_key, false, false);
+						p->remove(this, *deleted_key, false, false, path);
 						// return;
 						p->set_leftmost_ptr(tmp);
 						// if (num_keys == 0) delete tmp;
@@ -936,23 +2495,23 @@ void btree::btree_delete_internal
 			}
 			else {
 				int prev_idx = p->get_index(idx - 1);
-				if(p->hdr.records[prev_idx].ptr != p->hdr.records[idx].ptr) {
+				if(p->records[prev_idx].ptr != p->records[idx].ptr) {
 					
-					*deleted_key = p->hdr.records[idx].key;
-					*left_sibling = (page *)p->hdr.records[prev_idx].ptr;
-					page* tmp = (page*)p->hdr.records[idx].ptr;
+					*deleted_key = p->records[idx].key;
+					*left_sibling = (page *)from_pool(p->records[prev_idx].ptr);
+					page* tmp = (page*)from_pool(p->records[idx].ptr);
 					
 					if (prev_idx == p->hdr.first_index){
 						*left_left_sibling = p->hdr.leftmost_ptr;
 					}else{
-						*left_left_sibling = (page *)p->hdr.records[p->get_index(prev_idx - 1)].ptr;
+						*left_left_sibling = (page *)from_pool(p->records[p->get_index(prev_idx - 1)].ptr);
 					}
 					int num_keys = (tmp)->count();
 					if (((*left_sibling)->count() < (int)((cardinality-1) *0.5) && num_keys-1 < (int)((cardinality-1) *0.5) )
 					){
 						
-						p->remove(this, *deleted_key, false, false);
-						p->hdr.records[prev_idx].ptr = (char*)tmp;
+						p->remove(this, *deleted_key, false, false, path);
+						p->records[prev_idx].ptr = to_pool((char*)tmp);
 						// if (num_keys == 0) delete tmp;
 					}else if (num_keys == 0){
 						// p->remove(this, *deleted_key, false, false);
@@ -967,29 +2526,35 @@ void btree::btree_delete_internal
 	}
 }
 
-// Function to search keys from "min" to "max"
-void btree::btree_search_range
-(entry_key_t min, entry_key_t max, unsigned long *buf) {
-	page *p = (page *)root;
-
-	while(p) {
-		if(p->hdr.leftmost_ptr != nullptr) {
-			// The current page is internal
-			p = (page *)p->linear_search(min);
-		}
-		else {
-			// Found a leaf
-			p->linear_search_range(min, max, buf);
+// Store the values of up to limit keys in [min, max) into buf in key
+// order and return how many were found
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+int btree_t<Key, Value, Cardinality, Layout>::btree_search_range
+(entry_key_t min, entry_key_t max, unsigned long *buf, int limit) {
+	btree_iterator it(this);
+	int num = 0;
+	for(it.seek(min); num < limit && it.valid() && it.key() < max; it.next())
+		buf[num++] = (unsigned long)it.value();
+	return num;
+}
 
-			break;
-		}
-	}
+// Store the values of up to limit keys in [min, max) into buf in
+// descending key order and return how many were found
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+int btree_t<Key, Value, Cardinality, Layout>::btree_search_range_reverse
+(entry_key_t min, entry_key_t max, unsigned long *buf, int limit) {
+	btree_reverse_iterator it(this);
+	int num = 0;
+	for(it.seek(max); num < limit && it.valid() && it.key() >= min; it.next())
+		buf[num++] = (unsigned long)it.value();
+	return num;
 }
 
-void btree::printAll(){
+template <typename Key, typename Value, int Cardinality, node_layout_t Layout>
+void btree_t<Key, Value, Cardinality, Layout>::printAll(){
 	int total_keys = 0;
 	page *leftmost = (page *)root;
-	printf("root: %x\n", root);
+	printf("root: %x\n", (char *)root);
 	if(root) {
 		do {
 			page *sibling = leftmost;
@@ -1007,3 +2572,8 @@ void btree::printAll(){
 
 	printf("total number of keys: %d\n", total_keys);
 }
+
+// The tree the drivers use, sized by record_size in config.h
+using btree = btree_t<entry_key_t, char *, record_size>;
+using btree_iterator = btree_iterator_t<entry_key_t, char *, record_size>;
+using btree_reverse_iterator = btree_reverse_iterator_t<entry_key_t, char *, record_size>;
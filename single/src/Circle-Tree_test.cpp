@@ -54,10 +54,18 @@ int main(int argc, char** argv)
     int num_data = 0;
     int n_threads = 1;
     float selection_ratio = 0.0f;
+    search_mode_t search_mode = LINEAR_SEARCH;
     char *input_path = (char *)std::string("../sample_input.txt").data();
+    char *pool_path = nullptr;
+    bool skip_insert = false;
+    double fill_factor = 0.0;
+    int scan_len = 0;
+    int batch = 0;
+    int put_batch = 0;
+    bool finger = false;
 
     int c;
-    while((c = getopt(argc, argv, "n:w:t:s:i:")) != -1) {
+    while((c = getopt(argc, argv, "n:w:t:s:i:bvp:xl:e:g:m:f")) != -1) {
         switch(c) {
         case 'n':
             num_data = atoi(optarg);
@@ -72,6 +80,34 @@ int main(int argc, char** argv)
             selection_ratio = atof(optarg);
         case 'i':
             input_path = optarg;
+            break;
+        case 'b':
+            search_mode = BINARY_SEARCH;
+            break;
+        case 'v':
+            search_mode = SIMD_SEARCH;
+            break;
+        case 'p':
+            pool_path = optarg;
+            break;
+        case 'x':
+            skip_insert = true;
+            break;
+        case 'l':
+            fill_factor = atof(optarg);
+            break;
+        case 'e':
+            scan_len = atoi(optarg);
+            break;
+        case 'g':
+            batch = atoi(optarg);
+            break;
+        case 'm':
+            put_batch = atoi(optarg);
+            break;
+        case 'f':
+            finger = true;
+            break;
         default:
             break;
         }
@@ -90,9 +126,29 @@ int main(int argc, char** argv)
     // }
 
     btree *bt;
-    bt = new btree();
     struct timespec start, end;
 
+    if(pool_path) {
+        clock_gettime(CLOCK_MONOTONIC,&start);
+
+        bt = btree::open(pool_path);
+        if(!bt)
+            exit(-1);
+        bt->set_search_mode(search_mode);
+
+        clock_gettime(CLOCK_MONOTONIC,&end);
+
+        long long elapsed_time = 
+        (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+        elapsed_time /= 1000;
+
+        printf("OPEN elapsed_time: %ld\n", elapsed_time);
+    }
+    else {
+        bt = new btree(search_mode);
+    }
+    bt->set_finger(finger);
+
     // Reading data
     entry_key_t* keys = new entry_key_t[num_data];
 
@@ -110,11 +166,39 @@ int main(int argc, char** argv)
 
     ifs.close();
 
-    {
+    if(!skip_insert && fill_factor > 0) {
         clock_gettime(CLOCK_MONOTONIC,&start);
 
-        for(int i = 0; i < num_data; ++i) {
-        bt->btree_insert(keys[i], (char *)keys[i]); 
+        vector<pair<entry_key_t, char *> > sorted(num_data);
+        for(int i = 0; i < num_data; ++i)
+            sorted[i] = make_pair(keys[i], (char *)keys[i]);
+        sort(sorted.begin(), sorted.end());
+        bt->bulk_load(sorted.begin(), sorted.end(), fill_factor, n_threads);
+
+        clock_gettime(CLOCK_MONOTONIC,&end);
+
+        long long elapsed_time = 
+        (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+        elapsed_time /= 1000;
+
+        printf("BULK LOAD elapsed_time: %ld, Avg: %f\n", elapsed_time,
+            (double)elapsed_time / num_data);
+    }
+    else if(!skip_insert) {
+        clock_gettime(CLOCK_MONOTONIC,&start);
+
+        if(put_batch > 0) {
+            char **values = new char *[num_data];
+            for(int i = 0; i < num_data; ++i)
+                values[i] = (char *)keys[i];
+            for(int i = 0; i < num_data; i += put_batch)
+                bt->multi_put(keys + i, values + i, min(put_batch, num_data - i));
+            delete[] values;
+        }
+        else {
+            for(int i = 0; i < num_data; ++i) {
+            bt->btree_insert(keys[i], (char *)keys[i]); 
+            }
         }
 
         clock_gettime(CLOCK_MONOTONIC,&end);
@@ -150,10 +234,17 @@ int main(int argc, char** argv)
     clear_cache();
 
     {
+    char **values = batch > 0 ? new char *[batch] : nullptr;
     clock_gettime(CLOCK_MONOTONIC,&start);
 
-    for(int i = 0; i < num_data; ++i) {
-        bt->btree_search(keys[i]);
+    if(batch > 0) {
+        for(int i = 0; i < num_data; i += batch)
+            bt->multi_get(keys + i, min(batch, num_data - i), values);
+    }
+    else {
+        for(int i = 0; i < num_data; ++i) {
+            bt->btree_search(keys[i]);
+        }
     }
 
     clock_gettime(CLOCK_MONOTONIC,&end);
@@ -164,6 +255,29 @@ int main(int argc, char** argv)
 
     printf("SEARCH elapsed_time: %ld, Avg: %f\n", elapsed_time,
         (double)elapsed_time / num_data);
+    delete[] values;
+    }
+
+    if(scan_len > 0) {
+    // as many scans as it takes to return about num_data values
+    int num_scans = num_data / scan_len;
+    unsigned long *buf = new unsigned long[scan_len];
+    long found = 0;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+
+    for(int i = 0; i < num_scans; ++i) {
+        found += bt->btree_search_range(keys[i], LONG_MAX, buf, scan_len);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&end);
+
+    long long elapsed_time = 
+        (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+    elapsed_time /= 1000;
+
+    printf("SCAN elapsed_time: %ld, Avg: %f, found: %ld\n", elapsed_time,
+        (double)elapsed_time / num_scans, found);
+    delete[] buf;
     }
 
     //bt->printAll();
@@ -171,7 +285,7 @@ int main(int argc, char** argv)
     
 
 
-    delete bt;
+    btree::close(bt);
     delete[] keys;
 
     return 0;
@@ -23,6 +23,7 @@
 #include <climits>
 #include <future>
 #include <mutex>
+#include <cpuid.h>
 #include "config.h"
 
 #define CPU_FREQ_MHZ (1566)
@@ -62,21 +63,76 @@ using namespace std;
 
 inline void mfence()
 {
+#ifdef CRASH_SIM
+  crash_sim_fence();
+#endif
   asm volatile("mfence":::"memory");
 }
 
+// Cache line write-back used by clflush(), picked once at startup from
+// CPUID. Legacy clflush is fenced on both sides; clflushopt and clwb are
+// weakly ordered and only need a single trailing sfence. PM_FLUSH=clflush,
+// clflushopt or clwb overrides the choice for benchmarking.
+enum flush_insn_t {FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB};
+
+static const char *flush_insn_name[] = {"clflush", "clflushopt", "clwb"};
+
+static flush_insn_t detect_flush_insn()
+{
+  unsigned int eax, ebx, ecx, edx;
+  bool supported[3] = {true, false, false};
+  if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)){
+    supported[FLUSH_CLFLUSHOPT] = (ebx >> 23) & 1;
+    supported[FLUSH_CLWB] = (ebx >> 24) & 1;
+  }
+  flush_insn_t insn = supported[FLUSH_CLWB] ? FLUSH_CLWB :
+    (supported[FLUSH_CLFLUSHOPT] ? FLUSH_CLFLUSHOPT : FLUSH_CLFLUSH);
+  const char *env = getenv("PM_FLUSH");
+  if(env){
+    for(int i = 0; i < 3; ++i){
+      if(!strcmp(env, flush_insn_name[i])){
+        if(supported[i]) insn = (flush_insn_t)i;
+        else fprintf(stderr, "PM_FLUSH=%s is not supported by this CPU\n", env);
+      }
+    }
+  }
+  fprintf(stderr, "flush instruction: %s\n", flush_insn_name[insn]);
+  return insn;
+}
+
+flush_insn_t flush_insn = detect_flush_insn();
+
+inline void sfence()
+{
+#ifdef CRASH_SIM
+  crash_sim_fence();
+#endif
+  asm volatile("sfence":::"memory");
+}
+
 inline void clflush(char *data, int len)
 {
   volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
   for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
+#ifdef CRASH_SIM
+    crash_sim_flush((char *)ptr);
+#endif
     unsigned long etsc = read_tsc() + 
       (unsigned long)(write_latency_in_ns*CPU_FREQ_MHZ/1000);
-    asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
+    if(flush_insn == FLUSH_CLWB)
+      asm volatile("clwb %0" : "+m" (*(volatile char *)ptr));
+    else if(flush_insn == FLUSH_CLFLUSHOPT)
+      asm volatile("clflushopt %0" : "+m" (*(volatile char *)ptr));
+    else
+      asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
     while (read_tsc() < etsc) cpu_pause();
-    //++clflush_cnt;
   }
-  mfence();
+  if(flush_insn == FLUSH_CLFLUSH)
+    mfence();
+  else
+    sfence();
 }
 
 class page;
@@ -96,9 +152,11 @@ class btree{
       (entry_key_t, char *, uint32_t, entry_key_t *, bool *, page **);
     char *btree_search(entry_key_t);
     void btree_search_range(entry_key_t, entry_key_t, unsigned long *); 
+    int btree_search_range_reverse(entry_key_t, entry_key_t, unsigned long *, int); 
     void printAll();
 
     friend class page;
+    friend class btree_reverse_iterator;
 };
 
 class header{
@@ -113,6 +171,7 @@ class header{
 
     friend class page;
     friend class btree;
+    friend class btree_reverse_iterator;
 
   public:
     header() {
@@ -151,6 +210,7 @@ class page{
 
   public:
     friend class btree;
+    friend class btree_reverse_iterator;
 
     page(uint32_t level = 0) {
       hdr.level = level;
@@ -172,7 +232,11 @@ class page{
 
     void *operator new(size_t size) {
       void *ret;
+#ifdef CRASH_SIM
+      ret = crash_sim_alloc(size);
+#else
       posix_memalign(&ret,64,size);
+#endif
       return ret;
     }
 
@@ -666,6 +730,38 @@ class page{
         }
       }
 
+    // Number of keys less than key, i.e. the index of the first one that
+    // is not
+    inline int lower_bound(entry_key_t key) {
+      int lo = 0, len = count();
+      while(len > 0) {
+        int half = len >> 1;
+        if(records[lo + half].key < key) {
+          lo += half + 1;
+          len -= half + 1;
+        }
+        else
+          len = half;
+      }
+      return lo;
+    }
+
+    // Copy the first hi entries of a leaf, from the last one backwards
+    int reverse_search_range(int hi, entry_key_t *keys, char **values) {
+      for(int i = hi - 1; i >= 0; --i) {
+        keys[hi - 1 - i] = records[i].key;
+        values[hi - 1 - i] = records[i].ptr;
+      }
+      return hi;
+    }
+
+    // Child of an internal node at index pos, -1 for leftmost_ptr
+    inline page *child(int pos) {
+      if(pos < 0)
+        return hdr.leftmost_ptr;
+      return (page *)records[pos].ptr;
+    }
+
     char *linear_search(entry_key_t key) {
       int i = 1;
       uint8_t previous_switch_counter;
@@ -840,6 +936,81 @@ class page{
     }
 };
 
+/*
+ *  class btree_reverse_iterator
+ */
+// Backward scan in key order: seek() positions the iterator at the last key
+// less than the given one, next() steps to smaller keys. Leaves only link
+// to the right, so the iterator keeps the path from the root with the child
+// taken at each level and steps to the previous leaf through the lowest
+// ancestor that has a child further left.
+class btree_reverse_iterator{
+  private:
+    btree *bt;
+    std::vector<std::pair<page *, int> > path;  // internal nodes and the child taken
+    page *leaf;
+    int pos, num;
+    entry_key_t keys[cardinality];
+    char *values[cardinality];
+
+    void descend(page *p, entry_key_t max, bool rightmost);
+    void previous_leaf();
+
+  public:
+    btree_reverse_iterator(btree *bt) : bt(bt), leaf(NULL), pos(0), num(0) {}
+    void seek(entry_key_t key);
+    void next();
+    bool valid() { return pos < num; }
+    entry_key_t key() { return keys[pos]; }
+    char *value() { return values[pos]; }
+};
+
+// Walk down from p to the leaf holding the largest key less than max, or
+// along the rightmost children, and buffer the keys below max
+void btree_reverse_iterator::descend(page *p, entry_key_t max, bool rightmost) {
+  while(p->hdr.leftmost_ptr != NULL) {
+    int c = rightmost ? p->count() - 1 : p->lower_bound(max) - 1;
+    path.push_back(std::make_pair(p, c));
+    p = p->child(c);
+  }
+  leaf = p;
+  pos = 0;
+  num = leaf->reverse_search_range(rightmost ? leaf->count() : leaf->lower_bound(max),
+      keys, values);
+}
+
+void btree_reverse_iterator::previous_leaf() {
+  num = pos = 0;
+  while(!path.empty()) {
+    std::pair<page *, int> &top = path.back();
+    if(top.second < 0) {
+      path.pop_back();
+      continue;
+    }
+    page *p = top.first->child(--top.second);
+    descend(p, 0, true);
+    if(num > 0)
+      return;
+  }
+}
+
+void btree_reverse_iterator::seek(entry_key_t key) {
+  path.clear();
+  descend((page *)bt->root, key, false);
+  if(num == 0)
+    previous_leaf();
+}
+
+void btree_reverse_iterator::next() {
+  if(++pos < num) {
+    // the leaf to the left hangs off the parent, fetch its header
+    if(pos == (num >> 1) && !path.empty() && path.back().second >= 0)
+      __builtin_prefetch(path.back().first->child(path.back().second - 1));
+    return;
+  }
+  previous_leaf();
+}
+
 /*
  *  class btree
  */
@@ -991,6 +1162,17 @@ void btree::btree_search_range
   }
 }
 
+// Store the values of up to limit keys in [min, max) into buf in
+// descending key order and return how many were found
+int btree::btree_search_range_reverse
+(entry_key_t min, entry_key_t max, unsigned long *buf, int limit) {
+  btree_reverse_iterator it(this);
+  int num = 0;
+  for(it.seek(max); num < limit && it.valid() && it.key() >= min; it.next())
+    buf[num++] = (unsigned long)it.value();
+  return num;
+}
+
 void btree::printAll(){
   int total_keys = 0;
   page *leftmost = (page *)root;
@@ -1,3 +1,7 @@
 
 #define PAGESIZE 4096
 const int record_size = 512;
+
+#ifdef CRASH_SIM
+#include "crash_sim.h"
+#endif
@@ -0,0 +1,150 @@
+/*
+   Crash-consistency simulation for the single-threaded trees, enabled by
+   building with -DCRASH_SIM (see crash_test.cpp).
+
+   Every cache line written back by clflush() is logged together with the
+   contents it had at that moment, and the next fence makes the logged copy
+   durable. Pages are allocated through crash_sim_alloc(), which registers
+   every line of them, whether it is ever flushed or not. A crash right after
+   fence k therefore leaves, for every registered or logged line, its last
+   copy made durable by fence k, and zero for lines that have none.
+   crash_sim_image(k) writes that image over the live lines so the tree can
+   be searched as it would be found after recovery, crash_sim_restore() puts
+   the live contents back.
+   */
+#ifndef CRASH_SIM_H_
+#define CRASH_SIM_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+#include <unordered_map>
+
+#define CRASH_LINE_SIZE 64
+
+struct crash_line {
+	char *addr;
+	uint64_t epoch;   // the fence that makes this copy durable
+	char data[CRASH_LINE_SIZE];
+};
+
+struct crash_sim_state {
+	bool enabled;
+	bool dirty;       // a line was logged since the last fence
+	uint64_t fences;  // persistence points seen so far
+	char *stack_lo, *stack_hi;
+	std::vector<crash_line> log;
+	std::unordered_map<char *, size_t> pages;  // registered page -> size
+	std::unordered_map<char *, crash_line> live;
+	std::unordered_map<char *, size_t> durable;
+	size_t replayed;  // log entries already folded into durable
+};
+
+crash_sim_state crash_sim;
+
+// Start logging; lines on the calling thread's stack are never logged,
+// they do not survive a crash and are reused while checking.
+inline void crash_sim_start()
+{
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+	pthread_getattr_np(pthread_self(), &attr);
+	pthread_attr_getstack(&attr, &addr, &size);
+	pthread_attr_destroy(&attr);
+	crash_sim.stack_lo = (char *)addr;
+	crash_sim.stack_hi = (char *)addr + size;
+	crash_sim.dirty = false;
+	crash_sim.fences = 0;
+	crash_sim.replayed = 0;
+	crash_sim.enabled = true;
+}
+
+inline void crash_sim_stop()
+{
+	crash_sim.enabled = false;
+}
+
+inline void crash_sim_flush(char *line)
+{
+	if(!crash_sim.enabled || (line >= crash_sim.stack_lo && line < crash_sim.stack_hi))
+		return;
+	crash_line l;
+	l.addr = line;
+	l.epoch = crash_sim.fences + 1;
+	memcpy(l.data, line, CRASH_LINE_SIZE);
+	crash_sim.log.push_back(l);
+	crash_sim.dirty = true;
+}
+
+inline void crash_sim_fence()
+{
+	if(crash_sim.enabled && crash_sim.dirty) {
+		++crash_sim.fences;
+		crash_sim.dirty = false;
+	}
+}
+
+// Allocate a page in whole cache lines, registered while logging so that
+// a line nothing flushed still belongs to the image
+inline void *crash_sim_alloc(size_t size)
+{
+	void *ret;
+	size = (size + CRASH_LINE_SIZE - 1) & ~(size_t)(CRASH_LINE_SIZE - 1);
+	if(posix_memalign(&ret, CRASH_LINE_SIZE, size))
+		return NULL;
+	if(crash_sim.enabled)
+		crash_sim.pages[(char *)ret] = size;
+	return ret;
+}
+
+// A registered page stays allocated: an image may still bring it back, and
+// its lines must not be handed out again while they are part of one
+inline void crash_sim_free(void *p)
+{
+	if(crash_sim.pages.find((char *)p) == crash_sim.pages.end())
+		free(p);
+}
+
+// Lay out the persistent image left by a crash right after fence k.
+// Images must be requested with non-decreasing k, and each one has to be
+// undone with crash_sim_restore() before anything else allocates memory:
+// a logged line may share its bytes with the allocator's bookkeeping.
+inline void crash_sim_image(uint64_t k)
+{
+	if(crash_sim.live.empty()) {
+		for(size_t i = 0; i < crash_sim.log.size(); ++i) {
+			crash_line &l = crash_sim.live[crash_sim.log[i].addr];
+			l.addr = crash_sim.log[i].addr;
+			memcpy(l.data, l.addr, CRASH_LINE_SIZE);
+		}
+		for(auto it = crash_sim.pages.begin(); it != crash_sim.pages.end(); ++it) {
+			for(size_t off = 0; off < it->second; off += CRASH_LINE_SIZE) {
+				crash_line &l = crash_sim.live[it->first + off];
+				l.addr = it->first + off;
+				memcpy(l.data, l.addr, CRASH_LINE_SIZE);
+			}
+		}
+	}
+	for(; crash_sim.replayed < crash_sim.log.size() &&
+			crash_sim.log[crash_sim.replayed].epoch <= k; ++crash_sim.replayed)
+		crash_sim.durable[crash_sim.log[crash_sim.replayed].addr] = crash_sim.replayed;
+
+	for(auto it = crash_sim.live.begin(); it != crash_sim.live.end(); ++it) {
+		auto d = crash_sim.durable.find(it->first);
+		if(d == crash_sim.durable.end())
+			memset(it->first, 0, CRASH_LINE_SIZE);
+		else
+			memcpy(it->first, crash_sim.log[d->second].data, CRASH_LINE_SIZE);
+	}
+}
+
+inline void crash_sim_restore()
+{
+	for(auto it = crash_sim.live.begin(); it != crash_sim.live.end(); ++it)
+		memcpy(it->first, it->second.data, CRASH_LINE_SIZE);
+}
+
+#endif
@@ -0,0 +1,155 @@
+// Crash-consistency check for one tree variant, e.g.
+//   g++ -O -std=c++11 -pthread -DCRASH_SIM -DTREE_HEADER='"FAST-FAIR.h"' crash_test.cpp
+// Inserts the keys and deletes the first -d of them again while logging
+// every flush, then replays a crash after each persistence point and
+// searches every key acknowledged before it whose delete had not started.
+#include <fstream>
+#include <new>
+#include <setjmp.h>
+#include <signal.h>
+
+#ifndef CRASH_SIM
+#define CRASH_SIM
+#endif
+#ifndef TREE_HEADER
+#define TREE_HEADER "Circle-Tree.h"
+#endif
+#include TREE_HEADER
+
+using namespace std;
+
+sigjmp_buf recover_env;
+
+// SIGSEGV, SIGBUS or SIGALRM while searching a crash image
+void recover_fault(int)
+{
+	siglongjmp(recover_env, 1);
+}
+
+// Search the keys acknowledged by fence k in the current image, skipping
+// those whose delete had started by then. Returns how many are missing,
+// or -1 if the search faulted. Only lost changes after sigsetjmp, so it is
+// the only local that has to survive the jump back.
+long search_image(btree *bt, entry_key_t *keys, uint64_t *acked, int num_data,
+		uint64_t *deleting, int num_deletes, uint64_t k)
+{
+	volatile long lost = 0;
+	if(sigsetjmp(recover_env, 1) == 0) {
+		alarm(10);
+		for(int i=0; i<num_data && acked[i] <= k; ++i) {
+			if(i < num_deletes && deleting[i] < k)
+				continue;
+			if(bt->btree_search(keys[i]) != (char*) keys[i])
+				++lost;
+		}
+	}
+	else
+		lost = -1;
+	alarm(0);
+	return lost;
+}
+
+int main(int argc, char** argv)
+{
+	int num_data = 1000;
+	int num_deletes = 0;
+	uint64_t stride = 1;
+	char *input_path = (char *)std::string("../sample_input.txt").data();
+
+	int c;
+	while((c = getopt(argc, argv, "n:i:d:s:")) != -1) {
+		switch(c) {
+			case 'n':
+				num_data = atoi(optarg);
+				break;
+			case 'i':
+				input_path = optarg;
+				break;
+			case 'd':
+				num_deletes = atoi(optarg);
+				break;
+			case 's':
+				stride = atol(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+
+	entry_key_t* keys = new entry_key_t[num_data];
+	uint64_t* acked = new uint64_t[num_data];
+	if(num_deletes > num_data)
+		num_deletes = num_data;
+	// fences seen before the delete of keys[i] began
+	uint64_t* deleting = new uint64_t[num_deletes];
+
+	ifstream ifs;
+	ifs.open(input_path);
+	if(!ifs) {
+		cout << "input loading error!" << endl;
+		delete[] keys;
+		delete[] acked;
+		delete[] deleting;
+		exit(-1);
+	}
+	for(int i=0; i<num_data; ++i)
+		ifs >> keys[i];
+	ifs.close();
+
+	// the tree object gets its own cache lines so that replaying an image
+	// never touches the driver's data
+	void *mem;
+	if(posix_memalign(&mem, CACHE_LINE_SIZE, (sizeof(btree) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1)))
+		exit(-1);
+
+	crash_sim_start();
+	btree *bt = new (mem) btree();
+	clflush((char *)bt, sizeof(btree));
+	for(int i=0; i<num_data; ++i) {
+		bt->btree_insert(keys[i], (char*) keys[i]);
+		acked[i] = crash_sim.fences;
+	}
+	for(int i=0; i<num_deletes; ++i) {
+		deleting[i] = crash_sim.fences;
+		bt->btree_delete(keys[i]);
+	}
+	crash_sim_stop();
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = recover_fault;
+	sigaction(SIGSEGV, &sa, nullptr);
+	sigaction(SIGBUS, &sa, nullptr);
+	// a search looping on a broken image counts as a fault too
+	sigaction(SIGALRM, &sa, nullptr);
+
+	uint64_t checked = 0, failed = 0, faults = 0, first_failed = 0;
+	for(uint64_t k = 1; k <= crash_sim.fences; k += stride) {
+		crash_sim_image(k);
+		++checked;
+		long lost = search_image(bt, keys, acked, num_data, deleting, num_deletes, k);
+		crash_sim_restore();
+		if(lost < 0) {
+			++faults;
+			lost = 1;
+		}
+		if(lost) {
+			if(failed++ == 0)
+				first_failed = k;
+			if(failed <= 10)
+				printf("crash after fence %lu: %ld acknowledged keys lost\n", k, lost);
+		}
+	}
+
+	printf("CRASH points: %lu, checked: %lu, failed: %lu, faults: %lu",
+			crash_sim.fences, checked, failed, faults);
+	if(failed)
+		printf(", first failure after fence %lu", first_failed);
+	printf("\n");
+
+	delete[] keys;
+	delete[] acked;
+	delete[] deleting;
+
+	return failed ? 1 : 0;
+}